@@ -0,0 +1,71 @@
+#include "shop.hpp"
+#include "snl.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Buy throughput over many users with one global lock compared with the shop's per-user lock stripes
+
+constexpr size_t USERS = 1'000'000;
+constexpr auto DURATION = std::chrono::milliseconds(500);
+
+table<user> make_users()
+{
+    table_builder<user> users;
+    for (size_t i = 0; i < USERS; i++) {
+        users.add("user" + std::to_string(i), { 0, 0, UINT64_MAX / 2 });
+    }
+    return users.build();
+}
+
+// Same critical section as the server's buy, minus the reply
+template<class Lock>
+double run(unsigned threads, std::vector<std::string>& names, Lock&& lock_user, shop& shop)
+{
+    std::atomic<bool> stop = false;
+    std::atomic<uint64_t> total = 0;
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng{ t };
+            std::uniform_int_distribution<size_t> pick{ 0, names.size() - 1 };
+            uint64_t done = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                user& user = shop.get_user(names[pick(rng)]).value().get();
+                auto guard = lock_user(user);
+                uint64_t cost = 28;
+                if (cost <= user.balance) {
+                    user.balance -= cost;
+                }
+                done++;
+            }
+            total += done;
+        });
+    }
+    std::this_thread::sleep_for(DURATION);
+    stop = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return total / std::chrono::duration<double>(DURATION).count();
+}
+
+int main()
+{
+    shop shop{ make_users() };
+    std::vector<std::string> names;
+    for (size_t i = 0; i < USERS; i++) {
+        names.push_back("user" + std::to_string(i));
+    }
+    std::mutex global;
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        double global_ops = run(threads, names, [&](const user&) { return std::unique_lock<std::mutex>(global); }, shop);
+        double striped_ops = run(threads, names, [&](const user& user) { return shop.lock(user); }, shop);
+        std::printf("%3u threads: global lock %10.0f buys/s, striped %10.0f buys/s\n", threads, global_ops, striped_ops);
+    }
+}
@@ -1,4 +1,5 @@
 #include "snl.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <iostream>
@@ -10,11 +11,22 @@ int main()
     const char* user_cstr = std::getenv("USER");
     assert(user_cstr && "could not find user env variable");
     const std::string user = user_cstr;
+    snl::socket_options options;
+    if (std::getenv("SNL_LOW_LATENCY")) {
+        options = snl::socket_options::low_latency();
+    }
     snl::connect("127.0.0.1", 1234, [&](snl::connection& conn) {
         std::string in;
+        // the last listing and its version, the server only sends it again when it has changed
+        std::string listing_version;
+        std::string listing;
+        bool listing_requested = false;
         auto parser = snl::parsing::message_parser_builder{}
                         .command("list")
-                        .end([&](auto args) { conn.send("list"); })
+                        .end([&](auto args) {
+                            conn.send(listing_version.empty() ? "list" : "list " + listing_version);
+                            listing_requested = true;
+                        })
                         .command("bal")
                         .end([&](auto args) { conn.send(std::format("bal {}", user)); })
                         .command("buy")
@@ -24,12 +36,21 @@ int main()
                         .build();
         while (std::getline(std::cin, in)) {
             try {
+                listing_requested = false;
                 parser.parse(in);
                 auto res = conn.recv();
+                if (listing_requested && res.starts_with("version ")) {
+                    auto newline = std::min(res.find('\n'), res.size());
+                    listing_version = res.substr(8, newline - 8);
+                    listing = res.substr(std::min(newline + 1, res.size()));
+                    res = listing;
+                } else if (listing_requested && res == "not modified") {
+                    res = listing;
+                }
                 std::println("\e[0;34m{}\e[0m", res);
             } catch (const snl::parsing::parsing_exception& e) {
                 std::println("{}", e.what());
             }
         }
-    });
+    }, options);
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "snl.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compares hash map dispatch (message_parser) with the compile-time command_table (static_message_parser)
+
+template<size_t N>
+struct command_names
+{
+    constexpr command_names()
+    {
+        for (size_t i = 0; i < N; i++) {
+            auto& name = storage[i];
+            name = { 'c', 'm', 'd', '_', char('0' + i / 100), char('0' + i / 10 % 10), char('0' + i % 10) };
+            views[i] = std::string_view{ name.data(), name.size() };
+        }
+    }
+    std::array<std::array<char, 7>, N> storage{};
+    std::array<std::string_view, N> views{};
+};
+
+template<size_t N>
+constexpr command_names<N> names{};
+
+template<size_t N>
+constexpr snl::parsing::command_table<N> table{ names<N>.views };
+
+constexpr size_t ITERATIONS = 5'000'000;
+
+template<class Parser>
+double run(const Parser& parser, const std::vector<std::string>& messages)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        parser.parse(messages[i % messages.size()]);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / ITERATIONS;
+}
+
+template<size_t N>
+void bench()
+{
+    size_t calls = 0;
+    snl::parsing::message_parser_builder builder;
+    for (auto name : names<N>.views) {
+        builder.command(std::string{ name }).parameter("ARG").end([&](std::span<std::string_view> args) {
+            calls += args[0].size();
+        });
+    }
+    snl::parsing::message_parser_builder static_builder{ builder };
+    auto map_parser = builder.build();
+    auto static_parser = static_builder.build(table<N>);
+
+    std::mt19937 rng{ 42 };
+    std::uniform_int_distribution<size_t> pick{ 0, N - 1 };
+    std::vector<std::string> messages;
+    for (size_t i = 0; i < 4096; i++) {
+        messages.push_back(std::string{ names<N>.views[pick(rng)] } + " arg");
+    }
+
+    double map_ns = run(map_parser, messages);
+    double static_ns = run(static_parser, messages);
+    std::printf("%4zu commands: unordered_map %6.1f ns/parse, command_table %6.1f ns/parse (%zu)\n", N, map_ns,
+                static_ns, calls);
+}
+
+int main()
+{
+    bench<3>();
+    bench<30>();
+    bench<300>();
+}
@@ -1,142 +1,187 @@
+#include "shop.hpp"
 #include "snl.hpp"
+#include "wal.hpp"
+#include "watch.hpp"
 #include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <cstdlib>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <optional>
 #include <sstream>
+#include <system_error>
 #include <string>
+#include <thread>
 #include <vector>
 
-struct item
-{
-    std::string name;
-    uint64_t price;
-};
-struct user
-{
-    std::string name;
-    uint64_t balance;
-};
-struct shop
+int main()
 {
-    shop()
-    {
-        item item;
-        std::ifstream listing{ "shop.listing" };
-        while (listing >> item.name) {
-            assert(listing >> item.price);
-            items.emplace_back(std::move(item));
-        }
-        user user;
-        std::ifstream bal{ "shop.bal" };
-        while (bal >> user.name) {
-            assert(bal >> user.balance);
-            users.emplace_back(std::move(user));
-        }
+    std::filesystem::current_path(WORKING_DIRECTORY);
+    // The listing rarely changes, so list reads a snapshot of it without taking any lock
+    snl::sync::snapshot<listing> items{ table<item>::open("shop.listing") };
+    // Balances come from the latest snapshot (or shop.bal before the first one) with the log replayed on top
+    // Both may be text or the binary table format (see shop_convert), binary ones are mapped and used in place
+    // Text files are split into chunks that are parsed in parallel
+    std::string users_path = std::filesystem::exists("shop.snapshot") ? "shop.snapshot" : "shop.bal";
+    load_stats stats;
+    auto users = table<user>::open(users_path, &stats);
+    // a missing or empty file is not parsed at all and leaves nothing to measure
+    if (stats.records > 0 && stats.elapsed.count() > 0) {
+        std::cout << std::format("loaded {} users from {} ({}, {} threads) in {:.3f}s: {:.1f} MB/s, {:.0f} records/s",
+                                 stats.records, users_path, stats.binary ? "binary" : "text", stats.threads,
+                                 stats.elapsed.count(), stats.bytes / 1e6 / stats.elapsed.count(),
+                                 stats.records / stats.elapsed.count())
+                  << std::endl;
+    } else {
+        std::cout << std::format("no users in {}", users_path) << std::endl;
     }
-    ~shop() = default;
-
-    const std::vector<item>& list_items() const { return items; }
-    std::optional<std::reference_wrapper<user>> get_user(const std::string& name)
-    {
-        auto it = std::find_if(users.begin(), users.end(), [&name](const user& user) { return user.name == name; });
-        if (it != users.end()) {
-            return *it;
+    log_options log_options;
+    if (const char* mode = std::getenv("SNL_DURABILITY")) {
+        std::string_view name = mode;
+        log_options.mode = name == "async" ? durability::async
+                         : name == "interval" ? durability::interval
+                                              : durability::request;
+    }
+    if (const char* interval = std::getenv("SNL_SYNC_INTERVAL_MS")) {
+        log_options.interval = std::chrono::milliseconds(std::atoi(interval));
+    }
+    balance_log log{ "shop.wal", log_options };
+    log.replay([&](std::string_view name, uint64_t balance) {
+        if (user* user = users.find(name)) {
+            user->balance = balance;
         }
-        return {};
+    });
+    shop shop{ std::move(users), &log };
+    // Snapshots let the log be compacted, which keeps the replay above short however long the server has been up
+    std::chrono::seconds snapshot_interval{ 60 };
+    if (const char* interval = std::getenv("SNL_SNAPSHOT_INTERVAL_S")) {
+        snapshot_interval = std::chrono::seconds(std::atoi(interval));
     }
-    std::optional<std::reference_wrapper<item>> get_item(const std::string& name)
-    {
-        auto it = std::find_if(items.begin(), items.end(), [&name](const item& item) { return item.name == name; });
-        if (it != items.end()) {
-            return *it;
+    std::thread{ [&, last = uint64_t{ 0 }]() mutable {
+        while (true) {
+            std::this_thread::sleep_for(snapshot_interval);
+            uint64_t position = log.position();
+            if (position == last) {
+                continue;
+            }
+            try {
+                shop.copy_users().save("shop.snapshot");
+                log.compact(position);
+                last = position;
+            } catch (const std::exception& e) {
+                std::cerr << "snapshot failed: " << e.what() << '\n';
+            }
+        }
+    } }.detach();
+    // A new shop.listing is parsed on this thread and then published, list and buy calls that already loaded the old
+    // one finish with it. Binary listings are mapped, so they have to be replaced by a rename (as shop_convert does)
+    // rather than rewritten in place
+    std::thread{ [&, watcher = std::make_shared<file_watcher>(".", std::vector<std::string>{ "shop.listing" })] {
+        while (true) {
+            watcher->wait();
+            try {
+                items.store(listing{ table<item>::open("shop.listing") });
+                auto current = items.load();
+                std::cout << std::format("reloaded shop.listing ({} items, version {})", current->items.size(),
+                                         current->version)
+                          << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "reloading shop.listing failed, keeping the current listing: " << e.what() << '\n';
+            }
         }
-        return {};
+    } }.detach();
+    snl::serve_options options;
+    if (std::getenv("SNL_LOW_LATENCY")) {
+        options.socket = snl::socket_options::low_latency();
     }
-
-private:
-    std::vector<item> items;
-    std::vector<user> users;
-};
-
-int main()
-{
-    std::filesystem::current_path(WORKING_DIRECTORY);
-    snl::sync::safe<shop> shop;
-    snl::serve(1234, [&shop](snl::connection& conn) {
-        auto parser = snl::parsing::message_parser_builder{}
-                        .command("list")
-                        .end([&](auto args) {
-                            auto locked_shop = shop.lock();
-                            std::stringstream ss;
-                            for (auto& item : locked_shop->list_items()) {
-                                ss << item.name << ' ' << item.price << '\n';
-                            }
-                            auto str = std::move(ss.str());
-                            str.pop_back(); // remove last newline
-                            conn.send(std::move(str));
-                        })
-                        .command("bal")
-                        .parameter("USER")
-                        .end([&](auto args) {
-                            auto locked_shop = shop.lock();
-                            auto user = locked_shop->get_user(args[0]);
-                            if (user.has_value()) {
-                                conn.send(std::format("{} {}", user.value().get().name, user.value().get().balance));
-                            } else {
-                                conn.send(std::format("user {} does not exist", args[0]));
-                            }
-                        })
-                        .command("buy")
-                        .parameter("USER")
-                        .parameter("ITEM")
-                        .parameter("COUNT")
-                        .end([&](auto args) {
-                            auto locked_shop = shop.lock();
-                            auto user_res = locked_shop->get_user(args[0]);
-                            if (!user_res.has_value()) {
-                                conn.send(std::format("user '{}' does not exist", args[0]));
-                                return;
-                            }
-                            user& user = user_res.value().get();
-                            auto item_res = locked_shop->get_item(args[1]);
-                            if (!item_res.has_value()) {
-                                conn.send(std::format("item '{}' does not exist", args[1]));
-                                return;
-                            }
-                            item& item = item_res.value().get();
-                            uint64_t count;
+    // Built once and shared by every connection, the connection is passed to the handlers on each parse
+    auto parser = snl::parsing::basic_message_parser_builder<snl::connection>{}
+                    .command("list")
+                    .optional_parameter("VERSION")
+                    .end([&](snl::connection& conn, std::span<std::string_view> args) {
+                        // the reply was serialized when the listing was loaded, a client that has it gets a short one
+                        auto current = items.load();
+                        uint64_t version;
+                        const char* last = args[0].data() + args[0].size();
+                        auto [end, ec] = std::from_chars(args[0].data(), last, version);
+                        if (ec == std::errc{} && end == last && version == current->version) {
+                            conn.defer("not modified");
+                        } else {
+                            conn.defer(current->reply);
+                        }
+                    })
+                    .command("bal")
+                    .parameter<std::string_view>("USER")
+                    .end([&](snl::connection& conn, std::string_view user_name) {
+                        auto user = shop.get_user(user_name);
+                        if (user.has_value()) {
+                            auto balance = shop.balance(user.value());
+                            // the balance may come from a buy that is not durable yet, it is only shown once it is.
+                            // Usually it already is and this returns without locking
                             try {
-                                count = std::stoull(args[2]);
-                            } catch (const std::exception&) {
-                                conn.send(std::format("invalid cound '{}'", args[2]));
-                                return;
-                            }
-                            uint64_t cost;
-                            if (__builtin_mul_overflow(item.price, count, &cost)) {
-                                conn.send(std::format("would overflow"));
-                                return;
-                            }
-                            if (cost > user.balance) {
-                                conn.send("insufficient balance");
+                                log.commit(balance.position);
+                            } catch (const std::system_error& e) {
+                                conn.defer(std::format("could not save the log: {}", e.what()));
                                 return;
                             }
-                            user.balance -= cost;
-                            std::stringstream ss;
-                            ss << std::format("{}x {} ordered\n", count, item.name);
-                            ss << std::format("deducted {} from you balance (current balance: {})", cost, user.balance);
-                            conn.send(std::move(ss.str()));
-                        })
-                        .build();
+                            conn.defer(std::format("{} {}", shop.name(user.value()), balance.balance));
+                        } else {
+                            conn.defer(std::format("user {} does not exist", user_name));
+                        }
+                    })
+                    .command("buy")
+                    .parameter<std::string_view>("USER")
+                    .parameter<std::string_view>("ITEM")
+                    .parameter<uint64_t>("COUNT")
+                    .end([&](snl::connection& conn, std::string_view user_name, std::string_view item_name,
+                                 uint64_t count) {
+                        auto user_res = shop.get_user(user_name);
+                        if (!user_res.has_value()) {
+                            conn.defer(std::format("user '{}' does not exist", user_name));
+                            return;
+                        }
+                        user& user = user_res.value().get();
+                        auto current = items.load();
+                        const item* item = current->items.find(item_name);
+                        if (!item) {
+                            conn.defer(std::format("item '{}' does not exist", item_name));
+                            return;
+                        }
+                        uint64_t cost;
+                        if (__builtin_mul_overflow(item->price, count, &cost)) {
+                            conn.defer(std::format("would overflow"));
+                            return;
+                        }
+                        // the only part that holds the user's lock, the reply is built and sent after
+                        auto receipt = shop.withdraw(user, cost);
+                        if (!receipt.has_value()) {
+                            conn.defer("insufficient balance");
+                            return;
+                        }
+                        // only confirmed once it is durable, concurrent buys share the sync
+                        try {
+                            log.commit(receipt.value().position);
+                        } catch (const std::system_error& e) {
+                            // the balance has changed and the record stays queued, it is written once the log works
+                            conn.defer(std::format("order taken but not saved yet: {}", e.what()));
+                            return;
+                        }
+                        std::stringstream ss;
+                        ss << std::format("{}x {} ordered\n", count, current->items.name(*item));
+                        ss << std::format("deducted {} from you balance (current balance: {})", cost, receipt.value().balance);
+                        conn.defer(std::move(ss.str()));
+                    })
+                    .build();
+    snl::serve(1234, [&parser](snl::connection& conn) {
         for (auto& msg : conn) {
             try {
-                parser.parse(msg);
+                parser.parse(msg, conn);
             } catch (const snl::parsing::parsing_exception& e) {
                 conn.send(e.what());
             }
         }
-    });
+    }, options);
 }
\ No newline at end of file
@@ -0,0 +1,526 @@
+#pragma once
+
+#include "snl.hpp"
+#include "wal.hpp"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Records are fixed width, their names live in the table's string pool
+struct item
+{
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint64_t price;
+
+    static constexpr std::string_view magic = "SNLITEMS";
+    static constexpr auto value = &item::price;
+};
+struct user
+{
+    uint32_t name_offset;
+    uint32_t name_size;
+    uint64_t balance;
+
+    static constexpr std::string_view magic = "SNLUSERS";
+    static constexpr auto value = &user::balance;
+};
+
+template<class T>
+class table_builder;
+
+// What table::open did, for reporting load throughput
+struct load_stats
+{
+    bool binary = false;
+    size_t bytes = 0;
+    size_t records = 0;
+    unsigned threads = 1; // text chunks parsed in parallel
+    std::chrono::duration<double> elapsed{};
+};
+
+// Header, records, index slots and then the name pool, in one block that is either mmapped from a file as is or
+// built in memory from the text format. The index is open addressing (linear probing) over the record positions
+template<class T>
+class table
+{
+public:
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t count;
+        uint64_t slots;
+        uint64_t pool_size;
+    };
+    struct slot
+    {
+        uint32_t hash = 0; // upper half of the name's hash, compared before the names
+        uint32_t pos = EMPTY;
+    };
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+
+    table(const table&) = delete;
+    table& operator=(const table&) = delete;
+    table(table&& other) noexcept
+        : base(std::exchange(other.base, nullptr)), size_bytes(std::exchange(other.size_bytes, 0)),
+          mapped(other.mapped)
+    {
+    }
+    table& operator=(table&& other) noexcept
+    {
+        std::swap(base, other.base);
+        std::swap(size_bytes, other.size_bytes);
+        std::swap(mapped, other.mapped);
+        return *this;
+    }
+    ~table() { release(); }
+
+    // Maps a binary table file, or parses the text format ("name value" per line) if it does not start with the magic.
+    // A missing file gives an empty table
+    static table open(const std::string& path, load_stats* stats = nullptr)
+    {
+        auto start = std::chrono::steady_clock::now();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return table_builder<T>{}.build();
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            ::close(fd);
+            throw std::system_error{ errno, std::generic_category(), "fstat " + path };
+        }
+        size_t size = st.st_size;
+        if (size == 0) {
+            ::close(fd);
+            return table_builder<T>{}.build();
+        }
+        char magic[sizeof(header::magic)] = {};
+        if (size < sizeof(header) || pread(fd, magic, sizeof(magic), 0) != sizeof(magic)
+            || std::string_view{ magic, sizeof(magic) } != T::magic) {
+            void* text = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            ::close(fd);
+            if (text == MAP_FAILED) {
+                throw std::system_error{ errno, std::generic_category(), "mmap " + path };
+            }
+            unsigned threads = 1;
+            try {
+                table parsed = parse({ static_cast<const char*>(text), size }, threads);
+                munmap(text, size);
+                if (stats) {
+                    *stats = { false, size, parsed.size(), threads, std::chrono::steady_clock::now() - start };
+                }
+                return parsed;
+            } catch (...) {
+                munmap(text, size);
+                throw;
+            }
+        }
+        // private and writable, values change in memory only and the file is left alone
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::system_error{ errno, std::generic_category(), "mmap " + path };
+        }
+        table mapped_table;
+        mapped_table.base = static_cast<char*>(addr);
+        mapped_table.size_bytes = size;
+        mapped_table.mapped = true;
+        if (!mapped_table.valid()) {
+            throw std::runtime_error{ path + " is not a valid table file" };
+        }
+        if (stats) {
+            *stats = { true, size, mapped_table.size(), 1, std::chrono::steady_clock::now() - start };
+        }
+        return mapped_table;
+    }
+
+    // Writes the table as a binary file through a temporary one, so a crash leaves either the old or the new version
+    void save(const std::string& path) const
+    {
+        std::string tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            throw std::system_error{ errno, std::generic_category(), "open " + tmp };
+        }
+        size_t written = 0;
+        while (written < size_bytes) {
+            ssize_t n = ::write(fd, base + written, size_bytes - written);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                ::close(fd);
+                throw std::system_error{ errno, std::generic_category(), "write " + tmp };
+            }
+            written += n;
+        }
+        if (fdatasync(fd) == -1) {
+            ::close(fd);
+            throw std::system_error{ errno, std::generic_category(), "fdatasync " + tmp };
+        }
+        ::close(fd);
+        if (::rename(tmp.c_str(), path.c_str()) == -1) {
+            throw std::system_error{ errno, std::generic_category(), "rename " + tmp };
+        }
+        sync_directory(path);
+    }
+
+    // Same names and index, records left zeroed for the caller to fill in
+    table copy_without_records() const
+    {
+        table copy = allocate(size_bytes);
+        size_t records_end = sizeof(header) + size() * sizeof(T);
+        std::memcpy(copy.base, base, sizeof(header));
+        std::memcpy(copy.base + records_end, base + records_end, size_bytes - records_end);
+        return copy;
+    }
+
+    T* find(std::string_view name)
+    {
+        auto pos = slots()[probe(name, snl::fnv1a(name))].pos;
+        return pos == EMPTY ? nullptr : &records()[pos];
+    }
+    const T* find(std::string_view name) const { return const_cast<table*>(this)->find(name); }
+
+    std::string_view name(const T& record) const { return { pool() + record.name_offset, record.name_size }; }
+    std::span<T> all() { return { records(), size() }; }
+    std::span<const T> all() const { return { records(), size() }; }
+    size_t size() const { return head().count; }
+
+private:
+    table() = default;
+
+    static size_t layout_size(uint64_t count, uint64_t slots, uint64_t pool_size)
+    {
+        return sizeof(header) + count * sizeof(T) + slots * sizeof(slot) + pool_size;
+    }
+
+    // Checks a mapped file once, so lookups and name() can trust it: the sizes have to add up to the file size
+    // (without overflowing), names have to lie in the pool and slots have to point at records, with at least one
+    // slot empty so probing ends
+    bool valid() const
+    {
+        const header& h = head();
+        size_t room = size_bytes - sizeof(header);
+        if (h.version != VERSION || h.record_size != sizeof(T) || std::popcount(h.slots) != 1 || h.count >= h.slots
+            || h.slots > room / sizeof(slot) || h.count > room / sizeof(T) || h.pool_size > room
+            || layout_size(h.count, h.slots, h.pool_size) != size_bytes) {
+            return false;
+        }
+        for (const T& record : all()) {
+            if (uint64_t{ record.name_offset } + record.name_size > h.pool_size) {
+                return false;
+            }
+        }
+        size_t occupied = 0;
+        for (size_t i = 0; i < h.slots; i++) {
+            if (slots()[i].pos != EMPTY && (slots()[i].pos >= h.count || ++occupied == h.slots)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static table allocate(size_t size)
+    {
+        table t;
+        t.base = static_cast<char*>(::operator new(size, std::align_val_t{ alignof(T) }));
+        std::memset(t.base, 0, size);
+        t.size_bytes = size;
+        return t;
+    }
+    void release()
+    {
+        if (!base) {
+            return;
+        }
+        if (mapped) {
+            munmap(base, size_bytes);
+        } else {
+            ::operator delete(base, std::align_val_t{ alignof(T) });
+        }
+        base = nullptr;
+    }
+
+    // Splits text at line boundaries into a chunk per thread (at least CHUNK_MIN bytes each) and parses them in
+    // parallel, the chunks are merged in file order so duplicates resolve the same as a sequential parse
+    static constexpr size_t CHUNK_MIN = 1 << 20;
+    static table parse(std::string_view text, unsigned& threads)
+    {
+        threads = std::clamp<size_t>(text.size() / CHUNK_MIN, 1, std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<size_t> bounds{ 0 };
+        for (unsigned i = 1; i < threads; i++) {
+            size_t newline = text.find('\n', std::max(bounds.back(), text.size() / threads * i));
+            if (newline == std::string_view::npos) {
+                break;
+            }
+            bounds.push_back(newline + 1);
+        }
+        bounds.push_back(text.size());
+        threads = bounds.size() - 1;
+
+        std::vector<table_builder<T>> builders(threads);
+        std::vector<std::exception_ptr> errors(threads);
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; i++) {
+            workers.emplace_back([&, i] {
+                try {
+                    builders[i] = parse_chunk(text.substr(bounds[i], bounds[i + 1] - bounds[i]));
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+        try {
+            builders[0] = parse_chunk(text.substr(0, bounds[1]));
+        } catch (...) {
+            errors[0] = std::current_exception();
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (auto& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+        for (unsigned i = 1; i < threads; i++) {
+            builders[0].append(std::move(builders[i]));
+        }
+        return builders[0].build();
+    }
+
+    static table_builder<T> parse_chunk(std::string_view text)
+    {
+        table_builder<T> builder;
+        size_t pos = 0;
+        auto next = [&]() -> std::string_view {
+            while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+                pos++;
+            }
+            size_t start = pos;
+            while (pos < text.size() && !std::isspace(static_cast<unsigned char>(text[pos]))) {
+                pos++;
+            }
+            return text.substr(start, pos - start);
+        };
+        for (auto name = next(); !name.empty(); name = next()) {
+            auto number = next();
+            T record{};
+            auto [end, ec] = std::from_chars(number.data(), number.data() + number.size(), record.*T::value);
+            if (ec != std::errc{} || end != number.data() + number.size()) {
+                throw std::runtime_error{ std::format("invalid value '{}' for '{}'", number, name) };
+            }
+            builder.add(name, record);
+        }
+        return builder;
+    }
+
+    const header& head() const { return *reinterpret_cast<const header*>(base); }
+    T* records() const { return reinterpret_cast<T*>(base + sizeof(header)); }
+    slot* slots() const { return reinterpret_cast<slot*>(base + sizeof(header) + size() * sizeof(T)); }
+    char* pool() const { return base + size_bytes - head().pool_size; }
+
+    // slot holding name, or the empty slot where it would go
+    size_t probe(std::string_view name, uint64_t hash) const
+    {
+        size_t mask = head().slots - 1;
+        auto fingerprint = static_cast<uint32_t>(hash >> 32);
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            const slot& s = slots()[i];
+            if (s.pos == EMPTY || (s.hash == fingerprint && this->name(records()[s.pos]) == name)) {
+                return i;
+            }
+        }
+    }
+
+    char* base = nullptr;
+    size_t size_bytes = 0;
+    bool mapped = false;
+    friend class table_builder<T>;
+};
+
+template<class T>
+class table_builder
+{
+public:
+    void add(std::string_view name, T record)
+    {
+        assert(pool.size() + name.size() <= UINT32_MAX);
+        record.name_offset = pool.size();
+        record.name_size = name.size();
+        pool.append(name);
+        records.push_back(record);
+    }
+
+    // adds the records of other after this builder's
+    void append(table_builder&& other)
+    {
+        assert(pool.size() + other.pool.size() <= UINT32_MAX);
+        for (T& record : other.records) {
+            record.name_offset += pool.size();
+        }
+        pool.append(other.pool);
+        records.insert(records.end(), other.records.begin(), other.records.end());
+    }
+
+    // duplicates are kept but only the first one is found, like a linear search would
+    table<T> build()
+    {
+        uint64_t slots = std::bit_ceil(std::max<size_t>(16, records.size() * 4 / 3 + 1));
+        table<T> t = table<T>::allocate(table<T>::layout_size(records.size(), slots, pool.size()));
+        typename table<T>::header h{};
+        std::memcpy(h.magic, T::magic.data(), sizeof(h.magic));
+        h.version = table<T>::VERSION;
+        h.record_size = sizeof(T);
+        h.count = records.size();
+        h.slots = slots;
+        h.pool_size = pool.size();
+        std::memcpy(t.base, &h, sizeof(h));
+        std::memcpy(t.records(), records.data(), records.size() * sizeof(T));
+        std::fill_n(t.slots(), slots, typename table<T>::slot{});
+        std::memcpy(t.pool(), pool.data(), pool.size());
+        for (size_t i = 0; i < records.size(); i++) {
+            std::string_view name = t.name(records[i]);
+            uint64_t hash = snl::fnv1a(name);
+            auto& s = t.slots()[t.probe(name, hash)];
+            if (s.pos == table<T>::EMPTY) {
+                s = { static_cast<uint32_t>(hash >> 32), static_cast<uint32_t>(i) };
+            }
+        }
+        return t;
+    }
+
+private:
+    std::vector<T> records;
+    std::string pool;
+};
+
+// A version of the items with the list reply serialized once, every list call shares it until the items change.
+// The version is a hash of the items, so it holds across reloads of an unchanged file and across restarts
+struct listing
+{
+    explicit listing(table<item>&& items) : items(std::move(items))
+    {
+        std::string lines;
+        for (auto& item : this->items.all()) {
+            char price[20];
+            auto end = std::to_chars(price, price + sizeof(price), item.price).ptr;
+            lines += '\n';
+            lines += this->items.name(item);
+            lines += ' ';
+            lines.append(price, end);
+        }
+        version = snl::fnv1a(lines);
+        reply = std::make_shared<const std::string>("version " + std::to_string(version) + lines);
+    }
+
+    table<item> items;
+    uint64_t version;
+    std::shared_ptr<const std::string> reply; // "version V" followed by a "name price" line per item
+};
+
+// The set of users is fixed once loaded, so lookups need no lock, balances are guarded by the user's lock stripe.
+// With a log every balance change is appended to it under that lock, which keeps each user's records in order
+struct shop
+{
+    struct receipt
+    {
+        uint64_t balance;
+        uint64_t position; // of the log record, to commit
+    };
+
+    explicit shop(table<user>&& users, balance_log* log = nullptr)
+        : users(std::move(users)), last_records(this->users.size()), log(log)
+    {
+    }
+    shop(const shop&) = delete;
+    shop& operator=(const shop&) = delete;
+    ~shop() = default;
+
+    std::unique_lock<std::mutex> lock(const user& user) { return stripes.lock(index(user)); }
+    std::string_view name(const user& user) const { return users.name(user); }
+    // the balance and the position of the log record that set it (0 if it has not changed since startup), which has
+    // to be committed before the balance is shown
+    receipt balance(const user& user)
+    {
+        auto guard = lock(user);
+        return { user.balance, last_records[index(user)] };
+    }
+    // takes cost from the balance if it covers it and returns what is left. The new balance is visible to balance()
+    // right away, before its log record is committed
+    std::optional<receipt> withdraw(user& user, uint64_t cost)
+    {
+        auto guard = lock(user);
+        if (cost > user.balance) {
+            return {};
+        }
+        user.balance -= cost;
+        uint64_t position = log ? log->append(users.name(user), user.balance) : 0;
+        last_records[index(user)] = position;
+        return receipt{ user.balance, position };
+    }
+    // Copies every user, locking one stripe at a time so buys carry on. Users in different stripes may be copied at
+    // different points in time, replaying the log from a position taken before the copy makes up for that
+    table<user> copy_users()
+    {
+        table<user> copy = users.copy_without_records();
+        auto from = users.all();
+        auto to = copy.all();
+        for (size_t stripe = 0; stripe < stripes.size(); stripe++) {
+            auto guard = stripes.lock(stripe);
+            for (size_t i = stripe; i < from.size(); i += stripes.size()) {
+                to[i] = from[i];
+            }
+        }
+        return copy;
+    }
+
+    std::optional<std::reference_wrapper<user>> get_user(std::string_view name)
+    {
+        if (user* user = users.find(name)) {
+            return *user;
+        }
+        return {};
+    }
+    std::optional<std::reference_wrapper<const user>> get_user(std::string_view name) const
+    {
+        if (const user* user = users.find(name)) {
+            return *user;
+        }
+        return {};
+    }
+
+private:
+    size_t index(const user& user) const { return &user - users.all().data(); }
+
+    table<user> users;
+    std::vector<uint64_t> last_records; // log position per user, guarded by the user's stripe
+    snl::sync::striped_lock<> stripes;
+    balance_log* log;
+};
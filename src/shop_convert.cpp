@@ -0,0 +1,31 @@
+#include "shop.hpp"
+#include <cstdio>
+#include <exception>
+#include <string_view>
+
+// Converts shop.bal or shop.listing (text or binary) into the binary table format the server maps at startup
+template<class T>
+void convert(const char* from, const char* to)
+{
+    auto t = table<T>::open(from);
+    t.save(to);
+    std::printf("wrote %zu records to %s\n", t.size(), to);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 4 || (std::string_view{ argv[1] } != "users" && std::string_view{ argv[1] } != "items")) {
+        std::fprintf(stderr, "usage: %s users|items <input> <output>\n", argv[0]);
+        return 1;
+    }
+    try {
+        if (std::string_view{ argv[1] } == "users") {
+            convert<user>(argv[2], argv[3]);
+        } else {
+            convert<item>(argv[2], argv[3]);
+        }
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
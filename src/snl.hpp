@@ -23,20 +23,79 @@ Much thanks to:
  - https://internalpointers.com/post/writing-custom-iterators-modern-cpp
 */
 
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <arpa/inet.h>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <coroutine>
+#include <cstring>
+#include <deque>
 #include <exception>
+#include <fcntl.h>
 #include <format>
 #include <functional>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#include <memory>
+#include <mutex>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <optional>
+#include <pthread.h>
+#include <sched.h>
+#include <shared_mutex>
 #include <span>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <thread>
+#include <tuple>
+#include <type_traits>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// The io_uring backend needs the uapi headers of Linux 6.0 or newer (multishot recv, provided buffer rings). Built
+// against older ones io_backend::io_uring uses epoll, like it does when the running kernel lacks them
+#ifdef IORING_RECV_MULTISHOT
+#define SNL_IO_URING 1
+#else
+#define SNL_IO_URING 0
+#endif
 
 namespace snl {
 
+// 64-bit FNV-1a. Unlike std::hash it is the same across builds and platforms, so hashes may be stored on disk or
+// computed at compile time
+constexpr uint64_t fnv1a(std::string_view str)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (char c : str) {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3;
+    }
+    return h;
+}
+
 class connection_exception : public std::exception
 {
 public:
@@ -63,34 +122,243 @@ public:
 private:
 };
 
+// Called concurrently from every connection's thread, so it must be safe to share
 using connection_handler = std::function<void(struct connection&)>;
+// Called once per accepted connection, the handler it returns owns that connection's state
+using connection_handler_factory = std::function<connection_handler()>;
+
+struct socket_options
+{
+    bool nodelay = false;    // TCP_NODELAY, disables Nagle
+    bool cork = false;       // TCP_CORK while a batch of frames is being written
+    bool quickack = false;   // TCP_QUICKACK, rearmed before every blocking read since the kernel drops it on its own
+    int recv_buffer = 0;     // SO_RCVBUF in bytes, 0 keeps the kernel default
+    int send_buffer = 0;     // SO_SNDBUF in bytes, 0 keeps the kernel default
+    int backlog = SOMAXCONN; // listen backlog, only used by serve
+    int busy_poll = 0;       // SO_BUSY_POLL in microseconds, raising it needs CAP_NET_ADMIN
+    int fastopen = 0;        // TCP_FASTOPEN queue length for serve, any nonzero value enables it for connect
+
+    // small request/response round trips: no Nagle, no delayed ACKs and no handshake round trip on reconnects
+    static socket_options low_latency() { return { .nodelay = true, .quickack = true, .fastopen = 256 }; }
+};
+
+enum class overflow_policy
+{
+    reject, // drop the connection or message
+    block,  // wait for room in the queue
+    queue,  // ignore queue_depth
+};
+
+struct pool_options
+{
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t queue_depth = 1024; // tasks waiting across all workers
+    overflow_policy overflow = overflow_policy::block;
+};
+
+enum class io_backend
+{
+    epoll,
+    io_uring, // falls back to epoll when the kernel (or the headers it was built with) does not support it
+};
+
+struct serve_options
+{
+    socket_options socket;
+    // run connections (blocking serve) or messages (reactor serve) on a pool shared by all shards and loops instead
+    // of their own threads
+    std::optional<pool_options> workers;
+    // only used by the reactor variant of serve
+    unsigned loop_threads = std::max(1u, std::thread::hardware_concurrency());
+    io_backend backend = io_backend::epoll;
+    // number of SO_REUSEPORT listeners, each with its own acceptor (or event loop) pinned to its own core. 0 keeps a
+    // single listener shared by everything
+    unsigned shards = 0;
+};
 
 namespace detail {
-inline std::string recv(int fd)
-{
-    constexpr size_t CHUNK_SIZE = 1024;
-    int remaining;
-    int ret = ::recv(fd, &remaining, sizeof(remaining), 0);
-    if (ret == 0)
-        throw connection_closed_exception{ "" };
-    else if (ret != sizeof(remaining))
-        throw unknown_connection_exception{ "" };
-    std::string string{};
-    string.resize(remaining);
-    char* data = string.data();
-    while (remaining > 0) {
-        int recv = ::recv(fd, data, std::min((int)CHUNK_SIZE, (int)remaining), 0);
-        if (recv == 0)
-            throw connection_closed_exception{ "" };
-        else if (recv == -1)
+// Buffers everything the socket has available and decodes the length prefixed frames out of it, so a single recv
+// usually covers many frames and a partial frame is simply kept until the rest arrives.
+class frame_reader
+{
+public:
+    // the next complete frame in the buffer, valid until the reader is used again
+    std::optional<std::string_view> next()
+    {
+        auto frame = peek();
+        if (frame)
+            pop();
+        return frame;
+    }
+    // like next, but the frame stays at the front of the buffer
+    std::optional<std::string_view> peek() const
+    {
+        if (tail - head < sizeof(int))
+            return {};
+        int size;
+        std::memcpy(&size, data.get() + head, sizeof(size));
+        if (size < 0)
+            throw unknown_connection_exception{ "invalid frame length" };
+        if (tail - head - sizeof(size) < (size_t)size)
+            return {};
+        return std::string_view{ data.get() + head + sizeof(size), (size_t)size };
+    }
+    // drops the frame returned by peek
+    void pop()
+    {
+        int size;
+        std::memcpy(&size, data.get() + head, sizeof(size));
+        head += sizeof(size) + size;
+    }
+    bool has_frame() const
+    {
+        int size;
+        if (tail - head < sizeof(size))
+            return false;
+        std::memcpy(&size, data.get() + head, sizeof(size));
+        return size < 0 || tail - head - sizeof(size) >= (size_t)size;
+    }
+
+    // a single recv of whatever the socket has available, returns what recv returned
+    ssize_t fill(int fd)
+    {
+        reserve(wanted());
+        ssize_t ret;
+        do {
+            ret = ::recv(fd, data.get() + tail, capacity - tail, 0);
+        } while (ret == -1 && errno == EINTR);
+        if (ret > 0)
+            tail += ret;
+        return ret;
+    }
+    void append(const char* bytes, size_t size)
+    {
+        reserve(size);
+        std::memcpy(data.get() + tail, bytes, size);
+        tail += size;
+    }
+
+    // blocks until a complete frame is available, valid until the reader is used again
+    std::string_view read(int fd)
+    {
+        auto frame = wait(fd);
+        pop();
+        return frame;
+    }
+    // like read, but the frame stays at the front of the buffer
+    std::string_view wait(int fd)
+    {
+        while (true) {
+            if (auto frame = peek())
+                return *frame;
+            ssize_t ret = fill(fd);
+            if (ret == 0)
+                throw connection_closed_exception{ "" };
+            else if (ret == -1)
+                throw unknown_connection_exception{ "" };
+        }
+    }
+
+private:
+    static constexpr size_t READ_SIZE = 16 * 1024;
+
+    // room needed to receive the rest of the frame at the front of the buffer in one go
+    size_t wanted() const
+    {
+        int size;
+        if (has_frame() || tail - head < sizeof(size))
+            return READ_SIZE;
+        std::memcpy(&size, data.get() + head, sizeof(size));
+        return std::max(READ_SIZE, sizeof(size) + size - (tail - head));
+    }
+
+    void reserve(size_t size)
+    {
+        if (head == tail)
+            head = tail = 0;
+        if (capacity - tail >= size)
+            return;
+        if (head > 0) {
+            std::memmove(data.get(), data.get() + head, tail - head);
+            tail -= head;
+            head = 0;
+        }
+        if (capacity - tail >= size)
+            return;
+        size_t new_capacity = std::max(capacity * 2, tail + size);
+        std::unique_ptr<char[]> new_data{ new char[new_capacity] };
+        std::memcpy(new_data.get(), data.get(), tail);
+        data = std::move(new_data);
+        capacity = new_capacity;
+    }
+
+    std::unique_ptr<char[]> data;
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t tail = 0;
+};
+}
+
+namespace detail {
+inline void set_option(int fd, int level, int name, int value, const char* option)
+{
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == -1) {
+        throw unknown_connection_exception{ std::format("could not set {}", option) };
+    }
+}
+
+// options that have to be set before the socket is connected or listening, accepted sockets inherit them
+inline void apply_buffer_options(int fd, const socket_options& options)
+{
+    if (options.recv_buffer)
+        set_option(fd, SOL_SOCKET, SO_RCVBUF, options.recv_buffer, "SO_RCVBUF");
+    if (options.send_buffer)
+        set_option(fd, SOL_SOCKET, SO_SNDBUF, options.send_buffer, "SO_SNDBUF");
+}
+
+// options for a connected socket
+inline void apply_connection_options(int fd, const socket_options& options)
+{
+    if (options.nodelay)
+        set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (options.quickack)
+        set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    if (options.busy_poll)
+        set_option(fd, SOL_SOCKET, SO_BUSY_POLL, options.busy_poll, "SO_BUSY_POLL");
+}
+
+inline void write_all(int fd, iovec* iov, size_t count)
+{
+    size_t first = 0;
+    while (first < count) {
+        if (iov[first].iov_len == 0) {
+            first++;
+            continue;
+        }
+        msghdr msg{};
+        msg.msg_iov = iov + first;
+        msg.msg_iovlen = std::min<size_t>(count - first, IOV_MAX);
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
             throw unknown_connection_exception{ "" };
-        remaining -= recv;
-        data += recv;
+        }
+        for (; first < count && (size_t)sent >= iov[first].iov_len; first++) {
+            sent -= iov[first].iov_len;
+        }
+        if (sent > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + sent;
+            iov[first].iov_len -= sent;
+        }
     }
-    return string;
 }
 }
 
+namespace detail {
+inline void run_connection(const connection_handler& handler, int fd, const socket_options& options);
+}
+
 struct connection
 {
 public:
@@ -101,9 +369,27 @@ public:
 
     ~connection() = default;
 
-    std::string recv() { return detail::recv(fd); }
+    std::string recv() { return std::string{ read_frame() }; }
+    // the next frame without copying it, valid until the next receive on this connection
+    std::string_view recv_view() { return read_frame(); }
+    // copies the next frame into buffer and returns its size. If it is larger than buffer nothing is copied and the
+    // frame is left for the next receive, so it can be retried with a large enough buffer
+    size_t recv_into(std::span<char> buffer)
+    {
+        prepare_read();
+        auto frame = reader.wait(fd);
+        if (frame.size() <= buffer.size()) {
+            std::memcpy(buffer.data(), frame.data(), frame.size());
+            reader.pop();
+        }
+        return frame.size();
+    }
     std::optional<std::string> try_recv()
     {
+        if (reader.has_frame()) {
+            return recv();
+        }
+        flush();
         fd_set rfd;
         FD_ZERO(&rfd);
         FD_SET(fd, &rfd);
@@ -119,20 +405,73 @@ public:
             return {};
         }
     }
-    void send(const std::string& data)
+    // header and payload go out in a single gather write
+    void send(std::string_view data)
     {
-        const char* p = data.data();
-        int remaining = data.size();
-        if (::send(fd, &remaining, sizeof(remaining), 0) != sizeof(remaining)) {
-            throw unknown_connection_exception{ "" };
+        flush();
+        int size = data.size();
+        iovec iov[2] = { { &size, sizeof(size) }, { const_cast<char*>(data.data()), data.size() } };
+        detail::write_all(fd, iov, 2);
+    }
+    // coalesces several frames into as few gather writes as possible
+    void send_many(std::span<const std::string_view> frames)
+    {
+        flush();
+        auto corked = batch();
+        std::vector<int> sizes(frames.size());
+        std::vector<iovec> iov(frames.size() * 2);
+        for (size_t i = 0; i < frames.size(); i++) {
+            sizes[i] = frames[i].size();
+            iov[i * 2] = { &sizes[i], sizeof(int) };
+            iov[i * 2 + 1] = { const_cast<char*>(frames[i].data()), frames[i].size() };
         }
-        while (remaining > 0) {
-            int sent = ::send(fd, p, remaining, 0);
-            if (sent == -1)
-                throw unknown_connection_exception{ "" };
-            remaining -= sent;
-            p += sent;
+        detail::write_all(fd, iov.data(), iov.size());
+    }
+
+    // holds back partial segments while alive if socket_options::cork is set, so several sends leave as full ones
+    class batch_guard
+    {
+    public:
+        batch_guard(const batch_guard&) = delete;
+        batch_guard& operator=(const batch_guard&) = delete;
+        ~batch_guard()
+        {
+            if (fd != -1)
+                setsockopt(fd, IPPROTO_TCP, TCP_CORK, &OFF, sizeof(OFF));
+        }
+
+    private:
+        explicit batch_guard(int fd) : fd(fd)
+        {
+            if (fd != -1)
+                detail::set_option(fd, IPPROTO_TCP, TCP_CORK, 1, "TCP_CORK");
         }
+        static constexpr int OFF = 0;
+        int fd;
+        friend struct connection;
+    };
+    batch_guard batch() { return batch_guard{ options.cork ? fd : -1 }; }
+
+    // queues a reply instead of writing it right away, so it can be produced while holding a lock and sent after.
+    // Deferred replies go out in one gather write on flush, which also happens before any send, before blocking on
+    // a receive and when the handler returns
+    void defer(std::string data) { deferred.emplace_back(std::move(data)); }
+    // a reply shared with other connections (e.g. one serialized once and cached), kept alive until it is sent
+    void defer(std::shared_ptr<const std::string> data) { deferred.emplace_back(std::move(data)); }
+    void flush()
+    {
+        if (deferred.empty()) {
+            return;
+        }
+        auto pending = std::move(deferred);
+        deferred.clear();
+        std::vector<std::string_view> frames;
+        frames.reserve(pending.size());
+        for (auto& frame : pending) {
+            auto* shared = std::get_if<std::shared_ptr<const std::string>>(&frame);
+            frames.push_back(shared ? std::string_view{ **shared } : std::get<std::string>(frame));
+        }
+        send_many(frames);
     }
 
     struct connection_iterator_end_t
@@ -147,7 +486,7 @@ public:
 
         connection_iterator& operator++()
         {
-            current_value = detail::recv(fd);
+            current_value.assign(conn->read_frame()); // reuses the capacity of the previous message
             return *this;
         };
         void operator++(int) { ++*this; } // NOTE: this is some cursed bullshit, but chatgpt says its fine, so who cares
@@ -158,11 +497,11 @@ public:
         }
 
     private:
-        explicit connection_iterator(int fd) : fd(fd)
+        explicit connection_iterator(connection* conn) : conn(conn)
         {
             ++*this; // we make sure to read a value immediatly
         };
-        int fd;
+        connection* conn;
         std::string current_value = "THIS SHOULD NOT BE DISPLAYED";
         friend struct connection;
     };
@@ -171,21 +510,180 @@ public:
     static_assert(std::sentinel_for<connection_iterator_end_t, connection_iterator>,
                   "connection_iterator_end must be a sentinel for connection_iterator");
 
-    connection_iterator begin() { return connection_iterator{ fd }; }
+    connection_iterator begin() { return connection_iterator{ this }; }
     connection_iterator_end_t end() { return connection_iterator_end_t{}; }
 
 private:
-    connection(int fd) : fd(fd){};
+    connection(int fd, const socket_options& options) : fd(fd), options(options){};
+
+    std::string_view read_frame()
+    {
+        prepare_read();
+        return reader.read(fd);
+    }
+    // only when the read is going to block, replies to pipelined messages are then sent together
+    void prepare_read()
+    {
+        if (reader.has_frame()) {
+            return;
+        }
+        flush();
+        if (options.quickack) {
+            detail::set_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+        }
+    }
 
     int fd;
+    socket_options options;
+    detail::frame_reader reader;
+    std::vector<std::variant<std::string, std::shared_ptr<const std::string>>> deferred;
+
+    friend void detail::run_connection(const connection_handler&, int, const socket_options&);
+    friend void connect(std::string, uint16_t, connection_handler, socket_options);
+};
+
+// Fixed set of threads with one task deque each. Tasks are spread round robin over the deques (or pushed onto the
+// submitting worker's own one) and idle workers steal from the back of the others.
+class worker_pool
+{
+public:
+    explicit worker_pool(pool_options options = {}) : options(options)
+    {
+        for (unsigned i = 0; i < std::max(1u, options.threads); i++) {
+            workers.emplace_back(new worker);
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            threads.emplace_back([this, i] { run(i); });
+        }
+    }
+    worker_pool(const worker_pool&) = delete;
+    worker_pool& operator=(const worker_pool&) = delete;
+    // runs everything that was already queued before joining the workers
+    ~worker_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{ mtx };
+            stopping = true;
+        }
+        work_available.notify_all();
+        space_available.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // returns false if the task was rejected because the pool is full, the bound is approximate under contention
+    bool submit(std::function<void()> task)
+    {
+        if (options.overflow != overflow_policy::queue && queued >= options.queue_depth) {
+            if (options.overflow == overflow_policy::reject)
+                return false;
+            std::unique_lock<std::mutex> lock{ mtx };
+            blocked++;
+            space_available.wait(lock, [this] { return queued < options.queue_depth || stopping; });
+            blocked--;
+        }
+        size_t index = current_pool == this ? current_index : next++ % workers.size();
+        {
+            std::lock_guard<std::mutex> lock{ workers[index]->mtx };
+            workers[index]->tasks.push_back(std::move(task));
+        }
+        queued++;
+        if (idle > 0) {
+            std::lock_guard<std::mutex> lock{ mtx }; // a worker might be between checking queued and going to sleep
+            work_available.notify_one();
+        }
+        return true;
+    }
+
+private:
+    struct worker
+    {
+        std::mutex mtx;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void run(size_t index)
+    {
+        current_pool = this;
+        current_index = index;
+        while (true) {
+            if (auto task = take(index)) {
+                queued--;
+                if (blocked > 0) {
+                    std::lock_guard<std::mutex> lock{ mtx };
+                    space_available.notify_one();
+                }
+                (*task)();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock{ mtx };
+            idle++;
+            work_available.wait(lock, [this] { return queued > 0 || stopping; });
+            idle--;
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+
+    // the oldest task of our own deque, or the newest one of someone else's
+    std::optional<std::function<void()>> take(size_t index)
+    {
+        {
+            auto& own = *workers[index];
+            std::lock_guard<std::mutex> lock{ own.mtx };
+            if (!own.tasks.empty()) {
+                auto task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return task;
+            }
+        }
+        for (size_t i = 1; i < workers.size(); i++) {
+            auto& victim = *workers[(index + i) % workers.size()];
+            std::lock_guard<std::mutex> lock{ victim.mtx };
+            if (!victim.tasks.empty()) {
+                auto task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return task;
+            }
+        }
+        return {};
+    }
 
-    friend void serve(uint16_t, connection_handler);
-    friend void connect(std::string, uint16_t, connection_handler);
+    pool_options options;
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queued = 0;
+    std::atomic<size_t> next = 0;
+    std::atomic<unsigned> idle = 0;
+    std::atomic<unsigned> blocked = 0;
+    std::mutex mtx;
+    std::condition_variable work_available;
+    std::condition_variable space_available;
+    bool stopping = false;
+
+    static inline thread_local worker_pool* current_pool = nullptr;
+    static inline thread_local size_t current_index = 0;
 };
 
-inline void serve(uint16_t port, connection_handler handler)
+namespace detail {
+inline void run_connection(const connection_handler& handler, int fd, const socket_options& options)
+{
+    try {
+        connection conn{ fd, options };
+        apply_connection_options(fd, options);
+        handler(conn);
+        conn.flush();
+    } catch (const connection_exception&) {
+    }
+    close(fd);
+}
+}
+
+namespace detail {
+inline int listen_on(uint16_t port, const socket_options& options, bool reuseport = false)
 {
-    int sockfd, new_fd;
+    int sockfd;
     struct addrinfo hints = { 0 };
     struct addrinfo* res;
     struct addrinfo* r;
@@ -207,6 +705,10 @@ inline void serve(uint16_t port, connection_handler handler)
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
             throw unknown_connection_exception{ "" };
         }
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            throw unknown_connection_exception{ "" };
+        }
+        apply_buffer_options(sockfd, options);
         if (bind(sockfd, r->ai_addr, r->ai_addrlen) == -1) {
             close(sockfd);
             continue;
@@ -217,15 +719,51 @@ inline void serve(uint16_t port, connection_handler handler)
     if (r == NULL) {
         throw unknown_connection_exception{ "" };
     }
-#define BACKLOG 10
-    if (listen(sockfd, BACKLOG) == -1) {
+    if (options.fastopen) {
+        set_option(sockfd, IPPROTO_TCP, TCP_FASTOPEN, options.fastopen, "TCP_FASTOPEN");
+    }
+    if (listen(sockfd, options.backlog) == -1) {
         throw unknown_connection_exception{ "" };
     }
+    return sockfd;
+}
+
+// one listener per shard, or just the one if sharding is off
+inline std::vector<int> listen_sharded(uint16_t port, const serve_options& options)
+{
+    std::vector<int> listeners;
+    for (unsigned i = 0; i < std::max(1u, options.shards); i++) {
+        listeners.push_back(listen_on(port, options.socket, options.shards > 0));
+    }
+    return listeners;
+}
+
+// pins the calling thread to the index-th core it is allowed to run on, threads it creates afterwards inherit that
+inline void pin_to_core(unsigned index)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0)
+        return;
+    unsigned target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+// runs connections on pool if there is one, otherwise on a thread each
+inline void accept_loop(int sockfd, const connection_handler& handler, const serve_options& options, worker_pool* pool)
+{
+    int new_fd;
 
     char s[INET6_ADDRSTRLEN];
 
     struct sockaddr_storage their_addr;
-    std::vector<std::thread> threads;
     while (true) {
         socklen_t sin_size = sizeof(their_addr);
         new_fd = accept(sockfd, (struct sockaddr*)&their_addr, &sin_size);
@@ -235,27 +773,52 @@ inline void serve(uint16_t port, connection_handler handler)
 
         inet_ntop(their_addr.ss_family, &(((struct sockaddr_in*)&their_addr)->sin_addr), s, sizeof(s));
 
-        threads.emplace_back(
-          [](connection_handler&& handler, int fd) {
-              connection conn{ fd };
-              try {
-                  handler(conn);
-              } catch (const connection_exception&) {
-              }
-              close(fd);
-          },
-          std::move(handler),
-          new_fd);
+        if (pool) {
+            auto task = [&handler, &options, new_fd] { detail::run_connection(handler, new_fd, options.socket); };
+            if (!pool->submit(std::move(task)))
+                close(new_fd);
+            continue;
+        }
+        // handler outlives the loop, detached so finished threads release their stacks
+        std::thread{ [&handler, socket = options.socket, new_fd] { detail::run_connection(handler, new_fd, socket); } }
+          .detach();
     }
 
-    for (auto& thread : threads) {
-        thread.join();
+    close(sockfd);
+}
+}
+
+inline void serve(uint16_t port, connection_handler handler, serve_options options = {})
+{
+    auto listeners = detail::listen_sharded(port, options);
+    // one pool shared by every shard, created before the shards are pinned so its workers are not
+    std::optional<worker_pool> pool;
+    if (options.workers) {
+        pool.emplace(*options.workers);
+    }
+    worker_pool* workers = pool ? &*pool : nullptr;
+    if (!options.shards) {
+        detail::accept_loop(listeners[0], handler, options, workers);
+        return;
     }
+    std::vector<std::thread> shards;
+    for (size_t i = 0; i < listeners.size(); i++) {
+        shards.emplace_back([&, i] {
+            detail::pin_to_core(i);
+            detail::accept_loop(listeners[i], handler, options, workers);
+        });
+    }
+    for (auto& shard : shards) {
+        shard.join();
+    }
+}
 
-    close(sockfd);
+inline void serve(uint16_t port, connection_handler_factory factory, serve_options options = {})
+{
+    serve(port, connection_handler{ [factory = std::move(factory)](connection& conn) { factory()(conn); } }, options);
 }
 
-inline void connect(std::string addr, uint16_t port, connection_handler handler)
+inline void connect(std::string addr, uint16_t port, connection_handler handler, socket_options options = {})
 {
     int sockfd;
     struct addrinfo hints = { 0 };
@@ -274,6 +837,10 @@ inline void connect(std::string addr, uint16_t port, connection_handler handler)
         if (sockfd == -1) {
             throw unknown_connection_exception{ "" };
         }
+        detail::apply_buffer_options(sockfd, options);
+        if (options.fastopen) {
+            detail::set_option(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+        }
         if (::connect(sockfd, r->ai_addr, r->ai_addrlen) == -1) {
             close(sockfd);
             continue;
@@ -285,86 +852,1236 @@ inline void connect(std::string addr, uint16_t port, connection_handler handler)
         throw unknown_connection_exception{ std::format("could not connect to {}:{}", addr, port) };
     }
 
-    connection conn{ sockfd };
+    connection conn{ sockfd, options };
     try {
+        detail::apply_connection_options(sockfd, options);
         handler(conn);
+        conn.flush();
     } catch (const connection_exception&) {
     }
 
     close(sockfd);
 }
 
-namespace sync {
+template<class T = void>
+class task;
 
+namespace detail {
 template<class T>
-class lock
+struct task_result
 {
-public:
-    T* get() { return &data; }
-    T* operator->() { return &data; }
-
-private:
-    lock(T& data, std::mutex& mtx) : data(data), guard(mtx) {}
-
-    T& data;
-    std::lock_guard<std::mutex> guard;
-
-    template<class U>
-    friend class safe;
+    void return_value(T value) { result.emplace(std::move(value)); }
+    T get()
+    {
+        if (exception)
+            std::rethrow_exception(exception);
+        return std::move(*result);
+    }
+    std::optional<T> result;
+    std::exception_ptr exception;
+};
+template<>
+struct task_result<void>
+{
+    void return_void() {}
+    void get()
+    {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+    std::exception_ptr exception;
 };
+}
 
+// Lazily started coroutine, awaiting it runs it to completion and resumes the awaiter (symmetric transfer, so deep
+// chains of tasks do not grow the stack)
 template<class T>
-class safe
+class task
 {
 public:
-    ~safe() = default;
-    template<typename... Args>
-    safe(Args&&... args)
+    struct promise_type : detail::task_result<T>
     {
-        data = T(std::forward<Args>(args)...);
+        task get_return_object() { return task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        auto final_suspend() noexcept
+        {
+            struct final_awaiter
+            {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                {
+                    auto continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return final_awaiter{};
+        }
+        void unhandled_exception() { this->exception = std::current_exception(); }
+
+        std::coroutine_handle<> continuation;
+    };
+
+    task() = default;
+    task(const task&) = delete;
+    task(task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    task& operator=(const task&) = delete;
+    task& operator=(task&& other) noexcept
+    {
+        if (this != &other) {
+            if (handle)
+                handle.destroy();
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+    ~task()
+    {
+        if (handle)
+            handle.destroy();
     }
 
-    lock<T> lock() { return sync::lock(data, mtx); }
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+    T await_resume() { return handle.promise().get(); }
 
 private:
-    T data;
-    std::mutex mtx;
-};
+    explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
 
-}
+    std::coroutine_handle<promise_type> handle;
 
-namespace parsing {
+    friend class reactor_connection;
+};
 
-using command_handler = std::function<void(std::span<std::string>)>;
+struct reactor_handler;
 
 namespace detail {
-struct parameter
-{
-    parameter(const std::string& name) : name(name) {}
-    std::string name;
-};
-struct command
-{
-    command() = default;
-    command(std::vector<parameter>&& parameters) : parameters(parameters) {}
-    std::vector<parameter> parameters;
-    command_handler handler;
-};
+class loop_base;
+class event_loop;
+class uring_loop;
 }
 
-class parsing_exception : public std::exception
+// A connection owned by one of the event loops of the reactor variant of serve. Callbacks run on the owning loop
+// thread, or on a worker if serve_options::workers is set, but never concurrently for the same connection.
+class reactor_connection
 {
 public:
-    explicit parsing_exception(const std::string& message) : message(message) {}
-    const char* what() const noexcept override { return message.c_str(); }
+    reactor_connection(const reactor_connection&) = delete;
+    reactor_connection(reactor_connection&&) = delete;
+    reactor_connection& operator=(const reactor_connection&) = delete;
+    reactor_connection& operator=(reactor_connection&&) = delete;
 
-private:
-    std::string message;
+    ~reactor_connection() = default;
+
+    // queues a frame, it is written once the current callback returns
+    void send(std::string_view data)
+    {
+        int size = data.size();
+        std::lock_guard<std::mutex> lock{ mtx };
+        out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.append(data);
+    }
+    // closes the connection once everything queued has been written
+    void close() { closing = true; }
+
+    // only usable from a coroutine started by coroutine_handler
+    struct recv_awaiter
+    {
+        bool await_ready() const noexcept { return !conn.received.empty() || conn.peer_closed; }
+        void await_suspend(std::coroutine_handle<> awaiter) noexcept { conn.waiting = awaiter; }
+        std::string await_resume()
+        {
+            if (conn.received.empty())
+                throw connection_closed_exception{ "" };
+            std::string msg = std::move(conn.received.front());
+            conn.received.pop_front();
+            return msg;
+        }
+        reactor_connection& conn;
+    };
+    recv_awaiter async_recv() { return { *this }; }
+    // the frame is queued like with send, so this never has to suspend
+    std::suspend_never async_send(std::string_view data)
+    {
+        send(data);
+        return {};
+    }
+
+private:
+    explicit reactor_connection(int fd) : fd(fd) {}
+
+    void start(task<> coroutine)
+    {
+        root = std::move(coroutine);
+        resume(root.handle);
+    }
+    void deliver(std::string_view msg)
+    {
+        received.emplace_back(msg);
+        if (waiting)
+            resume(std::exchange(waiting, {}));
+    }
+    void abandon()
+    {
+        peer_closed = true;
+        if (waiting)
+            resume(std::exchange(waiting, {})); // lets async_recv throw so the coroutine can unwind
+        root = {};
+    }
+    void resume(std::coroutine_handle<> handle)
+    {
+        handle.resume();
+        if (!root.handle || !root.handle.done())
+            return;
+        closing = true; // the coroutine returned, like a blocking handler returning
+        auto exception = std::exchange(root.handle.promise().exception, {});
+        root = {};
+        if (exception) {
+            try {
+                std::rethrow_exception(exception);
+            } catch (const connection_exception&) {
+            }
+        }
+    }
+
+    int fd;
+    std::atomic<bool> closing = false;
+    bool dead = false;
+    detail::frame_reader reader;
+    // frames queued by send, swapped into sending by the loop so callbacks on workers never touch what is being written
+    std::mutex mtx;
+    std::string out;
+    std::string sending;
+    size_t out_pos = 0;
+    // messages waiting for a worker, guarded by mtx. Only one task drains them at a time to keep them in order
+    std::deque<std::string> inbox;
+    bool scheduled = false;
+    bool close_pending = false;
+    // the peer half closed, the connection is closed once the frames read before that are handled and answered.
+    // Only touched by the loop
+    bool read_closed = false;
+    // only used by the io_uring backend: the number of submitted operations that still reference this connection
+    unsigned inflight = 0;
+    // only used by coroutine_handler: the coroutine, messages it did not ask for yet, and where it waits for one
+    task<> root;
+    std::deque<std::string> received;
+    std::coroutine_handle<> waiting;
+    bool peer_closed = false;
+
+    friend class detail::loop_base;
+    friend class detail::event_loop;
+    friend class detail::uring_loop;
+    friend reactor_handler coroutine_handler(std::function<task<>(reactor_connection&)>);
+};
+
+struct reactor_handler
+{
+    std::function<void(reactor_connection&)> on_open;
+    std::function<void(reactor_connection&, std::string_view)> on_message;
+    std::function<void(reactor_connection&)> on_close;
+};
+
+// Runs one coroutine per connection on the reactor, so handlers can be written sequentially with co_await
+// conn.async_recv() while sharing the event loops. The connection is closed once the coroutine returns.
+inline reactor_handler coroutine_handler(std::function<task<>(reactor_connection&)> handler)
+{
+    auto shared = std::make_shared<std::function<task<>(reactor_connection&)>>(std::move(handler));
+    return {
+        .on_open = [shared](reactor_connection& conn) { conn.start((*shared)(conn)); },
+        .on_message = [](reactor_connection& conn, std::string_view msg) { conn.deliver(msg); },
+        .on_close = [](reactor_connection& conn) { conn.abandon(); },
+    };
+}
+
+namespace detail {
+class loop_base
+{
+public:
+    loop_base(const loop_base&) = delete;
+    loop_base& operator=(const loop_base&) = delete;
+
+protected:
+    loop_base(int listen_fd, const reactor_handler& handler, const serve_options& options, worker_pool* pool)
+      : listen_fd(listen_fd), handler(handler), options(options), pool(pool)
+    {
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd == -1) {
+            throw unknown_connection_exception{ "" };
+        }
+    }
+    ~loop_base()
+    {
+        for (auto& [fd, conn] : connections) {
+            ::close(fd);
+        }
+        ::close(wake_fd);
+    }
+
+    reactor_connection& add(int fd)
+    {
+        auto [it, inserted] = connections.try_emplace(fd, new reactor_connection{ fd });
+        return *it->second;
+    }
+    bool configure(reactor_connection& conn)
+    {
+        try {
+            detail::apply_connection_options(conn.fd, options.socket);
+        } catch (const connection_exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    // dispatches every complete frame in the input buffer, returns false if the connection should be dropped
+    bool dispatch(reactor_connection& conn)
+    {
+        try {
+            while (!conn.closing) {
+                auto msg = conn.reader.next();
+                if (!msg)
+                    break;
+                if (pool) {
+                    if (!schedule(conn, *msg))
+                        return false;
+                } else if (!invoke(handler.on_message, conn, *msg)) {
+                    return false;
+                }
+            }
+        } catch (const connection_exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    // hands the message to the pool, the connection stays alive until the task is done with it
+    bool schedule(reactor_connection& conn, std::string_view msg)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ conn.mtx };
+            conn.inbox.emplace_back(msg);
+            if (conn.scheduled)
+                return true;
+            conn.scheduled = true;
+        }
+        if (!pool->submit([this, ref = connections.at(conn.fd)] { drain(ref); })) {
+            std::lock_guard<std::mutex> lock{ conn.mtx };
+            conn.scheduled = false;
+            return false;
+        }
+        return true;
+    }
+    void drain(const std::shared_ptr<reactor_connection>& ref)
+    {
+        reactor_connection& conn = *ref;
+        while (true) {
+            std::string msg;
+            {
+                std::lock_guard<std::mutex> lock{ conn.mtx };
+                if (conn.inbox.empty() || conn.close_pending) {
+                    conn.scheduled = false;
+                    break;
+                }
+                msg = std::move(conn.inbox.front());
+                conn.inbox.pop_front();
+            }
+            if (!conn.closing && !invoke(handler.on_message, conn, std::string_view{ msg }))
+                conn.closing = true;
+        }
+        if (conn.close_pending) {
+            invoke(handler.on_close, conn); // the loop dropped it while we were busy
+            return;
+        }
+        wake(ref);
+    }
+
+    // asks the loop to flush a connection from another thread
+    void wake(const std::shared_ptr<reactor_connection>& conn)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ woken_mtx };
+            woken.push_back(conn);
+        }
+        uint64_t one = 1;
+        while (::write(wake_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+            ;
+    }
+    std::vector<std::shared_ptr<reactor_connection>> take_woken()
+    {
+        uint64_t count;
+        while (::read(wake_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+            ;
+        std::lock_guard<std::mutex> lock{ woken_mtx };
+        return std::exchange(woken, {});
+    }
+
+    // whether a task is still handling messages of the connection
+    bool busy(reactor_connection& conn)
+    {
+        std::lock_guard<std::mutex> lock{ conn.mtx };
+        return conn.scheduled;
+    }
+
+    // calls on_close now, or leaves it to the task draining the connection's messages if there is one
+    void closed(reactor_connection& conn)
+    {
+        {
+            std::lock_guard<std::mutex> lock{ conn.mtx };
+            conn.dead = true;
+            if (conn.scheduled) {
+                conn.close_pending = true;
+                return;
+            }
+        }
+        invoke(handler.on_close, conn);
+    }
+
+    // the frames queued since the last call, or nothing if the previous ones are still being written
+    bool take_output(reactor_connection& conn)
+    {
+        if (conn.out_pos < conn.sending.size())
+            return true;
+        conn.sending.clear();
+        conn.out_pos = 0;
+        std::lock_guard<std::mutex> lock{ conn.mtx };
+        std::swap(conn.out, conn.sending);
+        return !conn.sending.empty();
+    }
+
+    template<class... Args>
+    static bool invoke(const std::function<void(reactor_connection&, Args...)>& callback,
+                       reactor_connection& conn,
+                       Args... args)
+    {
+        if (!callback)
+            return true;
+        try {
+            callback(conn, args...);
+        } catch (const connection_exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    // how long the listener is left alone after accept failed, e.g. on running out of file descriptors. The pending
+    // connection keeps the listener readable, retrying right away would spin
+    static constexpr std::chrono::milliseconds ACCEPT_BACKOFF{ 100 };
+
+    int listen_fd;
+    int wake_fd;
+    const reactor_handler& handler;
+    const serve_options& options;
+    worker_pool* pool;
+    std::unordered_map<int, std::shared_ptr<reactor_connection>> connections;
+    std::mutex woken_mtx;
+    std::vector<std::shared_ptr<reactor_connection>> woken;
+};
+
+class event_loop : loop_base
+{
+public:
+    event_loop(int listen_fd, const reactor_handler& handler, const serve_options& options, worker_pool* pool)
+      : loop_base(listen_fd, handler, options, pool)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1) {
+            throw unknown_connection_exception{ "" };
+        }
+        // every loop waits on the same listener, EPOLLEXCLUSIVE makes sure only one of them is woken per connection
+        epoll_event ev{ .events = EPOLLIN | EPOLLEXCLUSIVE, .data = { .ptr = nullptr } };
+        epoll_event wake_ev{ .events = EPOLLIN, .data = { .ptr = &wake_fd } };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &wake_ev) == -1) {
+            ::close(epfd);
+            throw unknown_connection_exception{ "" };
+        }
+    }
+    ~event_loop() { ::close(epfd); }
+
+    void run()
+    {
+        constexpr int MAX_EVENTS = 64;
+        epoll_event events[MAX_EVENTS];
+        while (true) {
+            int timeout = -1;
+            if (!unfinished.empty()) {
+                timeout = 0;
+            } else if (accept_paused) {
+                auto left = accept_resume - std::chrono::steady_clock::now();
+                timeout = std::max<int>(0, std::chrono::ceil<std::chrono::milliseconds>(left).count());
+            }
+            int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                throw unknown_connection_exception{ "" };
+            }
+            if (accept_paused && std::chrono::steady_clock::now() >= accept_resume)
+                resume_accept();
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.ptr == &wake_fd) {
+                    for (auto& conn : take_woken()) {
+                        if (!conn->dead)
+                            update(*conn, true);
+                    }
+                    continue;
+                }
+                auto* conn = static_cast<reactor_connection*>(events[i].data.ptr);
+                if (!conn) {
+                    accept_all();
+                    continue;
+                }
+                if (conn->dead)
+                    continue; // dropped by an earlier event of this batch
+                bool alive = true;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    alive = read(*conn);
+                update(*conn, alive);
+            }
+            // connections that used up their read budget, they get no new edge for what is still unread
+            for (auto& conn : std::exchange(unfinished, {})) {
+                if (conn->dead)
+                    continue;
+                update(*conn, read(*conn));
+            }
+            dropped.clear();
+        }
+    }
+
+private:
+    // bytes read from one connection per wakeup, so a client that keeps sending cannot starve the others
+    static constexpr ssize_t READ_BUDGET = 256 * 1024;
+
+    void accept_all()
+    {
+        while (true) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                    pause_accept(); // the pending connection keeps the listener readable, it would spin otherwise
+                return;
+            }
+            auto& conn = add(fd);
+            // edge triggered, so interest never has to be changed when the output buffer fills up or drains
+            epoll_event ev{ .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data = { .ptr = &conn } };
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                ::close(fd);
+                connections.erase(fd);
+                continue;
+            }
+            if (!configure(conn) || !invoke(handler.on_open, conn) || !flush(conn))
+                drop(conn);
+        }
+    }
+    void pause_accept()
+    {
+        if (!accept_paused)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listen_fd, nullptr);
+        accept_paused = true;
+        accept_resume = std::chrono::steady_clock::now() + ACCEPT_BACKOFF;
+    }
+    void resume_accept()
+    {
+        epoll_event ev{ .events = EPOLLIN | EPOLLEXCLUSIVE, .data = { .ptr = nullptr } };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+            accept_resume = std::chrono::steady_clock::now() + ACCEPT_BACKOFF;
+            return;
+        }
+        accept_paused = false;
+    }
+
+    // writes what is queued and drops the connection if it is gone, or if it was half closed and everything read
+    // before that has been answered
+    void update(reactor_connection& conn, bool alive)
+    {
+        // checked before flushing, so replies a worker queued before it finished are part of this flush
+        bool finished = conn.read_closed && !busy(conn);
+        alive = flush(conn) && alive;
+        if (!alive || (finished && conn.sending.empty()))
+            drop(conn);
+    }
+
+    // reads until the socket is drained or the budget is used up and dispatches every complete frame, returns false
+    // if the connection is gone. A half close marks it read_closed
+    bool read(reactor_connection& conn)
+    {
+        bool eof = false;
+        ssize_t budget = READ_BUDGET;
+        while (true) {
+            ssize_t ret = conn.reader.fill(conn.fd);
+            if (ret == 0) {
+                eof = true;
+                break;
+            } else if (ret == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                return false;
+            }
+            budget -= ret;
+            if (budget <= 0) {
+                unfinished.push_back(connections.at(conn.fd));
+                break;
+            }
+        }
+        if (!eof && options.socket.quickack) {
+            int yes = 1;
+            setsockopt(conn.fd, IPPROTO_TCP, TCP_QUICKACK, &yes, sizeof(yes)); // the kernel drops it on its own
+        }
+        if (eof)
+            conn.read_closed = true;
+        return dispatch(conn);
+    }
+
+    // writes as much of the output buffer as the socket accepts, returns false if the connection should be dropped
+    bool flush(reactor_connection& conn)
+    {
+        while (take_output(conn)) {
+            ssize_t sent =
+              ::send(conn.fd, conn.sending.data() + conn.out_pos, conn.sending.size() - conn.out_pos, MSG_NOSIGNAL);
+            if (sent == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            conn.out_pos += sent;
+        }
+        return !conn.closing;
+    }
+
+    void drop(reactor_connection& conn)
+    {
+        int fd = conn.fd;
+        closed(conn);
+        ::close(fd); // closing also removes it from the epoll set
+        // later events of the current batch may still point at it, it is freed once the batch is done
+        auto it = connections.find(fd);
+        dropped.push_back(std::move(it->second));
+        connections.erase(it);
+        if (accept_paused)
+            resume_accept(); // a descriptor was just freed
+    }
+
+    int epfd;
+    std::vector<std::shared_ptr<reactor_connection>> unfinished;
+    std::vector<std::shared_ptr<reactor_connection>> dropped;
+    bool accept_paused = false;
+    std::chrono::steady_clock::time_point accept_resume;
+};
+
+#if SNL_IO_URING
+inline int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+inline int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+inline int io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// io_uring backend: one multishot accept per loop, multishot recv into a ring of provided buffers, and one send per
+// connection in flight which carries every frame queued since the previous one (so header and body always go out
+// together). A single io_uring_enter both submits and reaps.
+class uring_loop : loop_base
+{
+public:
+    uring_loop(int listen_fd, const reactor_handler& handler, const serve_options& options, worker_pool* pool)
+      : loop_base(listen_fd, handler, options, pool)
+    {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = ENTRIES * 8; // multishot requests produce many completions per submission
+        ring_fd = io_uring_setup(ENTRIES, &params);
+        if (ring_fd == -1) {
+            throw unknown_connection_exception{ "io_uring is not available" };
+        }
+        sq_entries = params.sq_entries;
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+        }
+        sq_map = map(sq_map_size, IORING_OFF_SQ_RING);
+        cq_map = single_mmap ? sq_map : map(cq_map_size, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe*>(map(sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+        if (!sq_map || !cq_map || !sqes) {
+            unmap();
+            throw unknown_connection_exception{ "" };
+        }
+        auto* sq = static_cast<char*>(sq_map);
+        auto* cq = static_cast<char*>(cq_map);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // provided buffer rings need 5.19, the same release that added multishot accept
+        buf_ring_size = BUF_COUNT * sizeof(io_uring_buf);
+        void* ring = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        buf_ring = ring == MAP_FAILED ? nullptr : static_cast<io_uring_buf*>(ring);
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+        reg.ring_entries = BUF_COUNT;
+        reg.bgid = BUF_GROUP;
+        if (!buf_ring || io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+            unmap();
+            throw unknown_connection_exception{ "io_uring provided buffer rings are not available" };
+        }
+        buffers.reset(new char[BUF_COUNT * BUF_SIZE]);
+        for (unsigned bid = 0; bid < BUF_COUNT; bid++) {
+            provide(bid);
+        }
+        arm_accept();
+        arm_wake();
+    }
+    ~uring_loop()
+    {
+        unmap();
+    }
+
+    void run()
+    {
+        while (true) {
+            int ret = io_uring_enter(ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+            if (ret == -1) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                throw unknown_connection_exception{ "" };
+            }
+            to_submit -= std::min<unsigned>(ret, to_submit);
+            unsigned head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe cqe = cqes[head & cq_mask];
+                __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+                complete(cqe);
+            }
+        }
+    }
+
+private:
+    static constexpr unsigned ENTRIES = 256;
+    static constexpr unsigned BUF_COUNT = 256;
+    static constexpr size_t BUF_SIZE = 16 * 1024;
+    static constexpr uint16_t BUF_GROUP = 0;
+
+    enum op : uint64_t
+    {
+        OP_ACCEPT,
+        OP_RECV,
+        OP_SEND,
+        OP_WAKE,
+        OP_ACCEPT_BACKOFF,
+    };
+
+    void* map(size_t size, off_t offset)
+    {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+    void unmap()
+    {
+        if (buf_ring)
+            munmap(buf_ring, buf_ring_size);
+        if (sqes)
+            munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+        if (cq_map && cq_map != sq_map)
+            munmap(cq_map, cq_map_size);
+        if (sq_map)
+            munmap(sq_map, sq_map_size);
+        ::close(ring_fd);
+    }
+
+    io_uring_sqe& next_sqe(uint64_t op, reactor_connection* conn)
+    {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            // the submission queue is full, hand it to the kernel before queueing more
+            int ret = io_uring_enter(ring_fd, to_submit, 0, 0);
+            to_submit -= std::min<unsigned>(std::max(ret, 0), to_submit);
+        }
+        unsigned index = tail & sq_mask;
+        io_uring_sqe& sqe = sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.user_data = reinterpret_cast<uint64_t>(conn) | op;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+        if (conn)
+            conn->inflight++;
+        return sqe;
+    }
+
+    void provide(unsigned bid)
+    {
+        io_uring_buf& buf = buf_ring[buf_tail & (BUF_COUNT - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(buffers.get() + bid * BUF_SIZE);
+        buf.len = BUF_SIZE;
+        buf.bid = bid;
+        // the ring tail overlays the reserved field of the first entry (see io_uring_buf_ring)
+        __atomic_store_n(&buf_ring[0].resv, ++buf_tail, __ATOMIC_RELEASE);
+    }
+
+    void arm_accept()
+    {
+        io_uring_sqe& sqe = next_sqe(OP_ACCEPT, nullptr);
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.fd = listen_fd;
+        sqe.accept_flags = SOCK_CLOEXEC;
+        if (multishot)
+            sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    // accept is armed again once the timeout expires
+    void arm_accept_backoff()
+    {
+        io_uring_sqe& sqe = next_sqe(OP_ACCEPT_BACKOFF, nullptr);
+        sqe.opcode = IORING_OP_TIMEOUT;
+        sqe.addr = reinterpret_cast<uint64_t>(&accept_backoff);
+        sqe.len = 1;
+    }
+    void arm_wake()
+    {
+        io_uring_sqe& sqe = next_sqe(OP_WAKE, nullptr);
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = wake_fd;
+        sqe.addr = reinterpret_cast<uint64_t>(&wake_count);
+        sqe.len = sizeof(wake_count);
+    }
+    void arm_recv(reactor_connection& conn)
+    {
+        io_uring_sqe& sqe = next_sqe(OP_RECV, &conn);
+        sqe.opcode = IORING_OP_RECV;
+        sqe.fd = conn.fd;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = BUF_GROUP;
+        if (multishot)
+            sqe.ioprio = IORING_RECV_MULTISHOT;
+    }
+    void arm_send(reactor_connection& conn)
+    {
+        io_uring_sqe& sqe = next_sqe(OP_SEND, &conn);
+        sqe.opcode = IORING_OP_SEND;
+        sqe.fd = conn.fd;
+        sqe.addr = reinterpret_cast<uint64_t>(conn.sending.data() + conn.out_pos);
+        sqe.len = conn.sending.size() - conn.out_pos;
+        sqe.msg_flags = MSG_NOSIGNAL;
+    }
+
+    // starts sending whatever was queued if no send is in flight yet
+    void flush(reactor_connection& conn)
+    {
+        if (conn.dead || !conn.sending.empty())
+            return;
+        if (!take_output(conn)) {
+            if (conn.closing)
+                kill(conn);
+            return;
+        }
+        arm_send(conn);
+    }
+
+    // closes a half closed connection once no task is handling its messages anymore, after sending what is queued.
+    // Called before flush, so replies a worker queued before it finished are still sent
+    void finish_if_done(reactor_connection& conn)
+    {
+        if (conn.read_closed && !conn.dead && !busy(conn))
+            conn.closing = true;
+    }
+
+    // makes every operation still referencing the connection complete, it is freed once the last one did
+    void kill(reactor_connection& conn)
+    {
+        if (!conn.dead) {
+            conn.dead = true;
+            shutdown(conn.fd, SHUT_RDWR);
+        }
+        if (conn.inflight == 0) {
+            int fd = conn.fd;
+            closed(conn);
+            ::close(fd);
+            connections.erase(fd);
+        }
+    }
+
+    void complete(const io_uring_cqe& cqe)
+    {
+        auto op = cqe.user_data & 7;
+        auto* conn = reinterpret_cast<reactor_connection*>(cqe.user_data & ~uint64_t{ 7 });
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        bool fell_back = false;
+        if (cqe.res == -EINVAL && multishot && (op == OP_ACCEPT || op == OP_RECV)) {
+            multishot = false; // kernel predates multishot recv, rearm everything as one shot requests
+            fell_back = true;
+        }
+        if (op == OP_ACCEPT_BACKOFF) {
+            arm_accept();
+            return;
+        }
+        if (op == OP_WAKE) {
+            for (auto& conn : take_woken()) {
+                finish_if_done(*conn);
+                flush(*conn);
+            }
+            arm_wake();
+            return;
+        }
+        if (op == OP_ACCEPT) {
+            if (cqe.res >= 0) {
+                auto& conn = add(cqe.res);
+                arm_recv(conn);
+                if (!configure(conn) || !invoke(handler.on_open, conn))
+                    kill(conn);
+                else
+                    flush(conn);
+            }
+            if (more)
+                return;
+            // EMFILE and the like fail every accept until something is closed, so those (and an EINVAL that was not
+            // the multishot fallback) wait a while first
+            if (cqe.res >= 0 || cqe.res == -EINTR || cqe.res == -ECONNABORTED || fell_back)
+                arm_accept();
+            else
+                arm_accept_backoff();
+            return;
+        }
+        if (!more)
+            conn->inflight--;
+        if (op == OP_RECV) {
+            if (cqe.flags & IORING_CQE_F_BUFFER) {
+                unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe.res > 0 && !conn->dead)
+                    conn->reader.append(buffers.get() + bid * BUF_SIZE, cqe.res);
+                provide(bid);
+            }
+            if (conn->dead) {
+                kill(*conn);
+            } else if (cqe.res == 0) {
+                conn->read_closed = true; // replies to the frames we already have are still sent
+                finish_if_done(*conn);
+                flush(*conn);
+            } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -EINVAL) {
+                kill(*conn);
+            } else {
+                if (!more)
+                    arm_recv(*conn); // ran out of provided buffers, or multishot is not supported
+                if (!dispatch(*conn))
+                    kill(*conn);
+                else
+                    flush(*conn);
+            }
+        } else if (op == OP_SEND) {
+            if (cqe.res < 0 || conn->dead) {
+                kill(*conn);
+                return;
+            }
+            conn->out_pos += cqe.res;
+            if (conn->out_pos < conn->sending.size()) {
+                arm_send(*conn);
+                return;
+            }
+            conn->sending.clear();
+            flush(*conn);
+        }
+    }
+
+    int ring_fd;
+    void* sq_map = nullptr;
+    void* cq_map = nullptr;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    unsigned to_submit = 0;
+    bool multishot = true;
+    uint64_t wake_count;
+    __kernel_timespec accept_backoff{ 0, std::chrono::nanoseconds(ACCEPT_BACKOFF).count() };
+
+    // io_uring_buf_ring itself is not usable from c++, its flexible array member is padded by an empty struct
+    io_uring_buf* buf_ring = nullptr;
+    size_t buf_ring_size;
+    uint16_t buf_tail = 0;
+    std::unique_ptr<char[]> buffers;
+};
+#endif
+
+template<class Loop>
+std::vector<std::unique_ptr<Loop>> make_loops(const std::vector<int>& listeners,
+                                              const reactor_handler& handler,
+                                              const serve_options& options,
+                                              worker_pool* pool)
+{
+    std::vector<std::unique_ptr<Loop>> loops;
+    unsigned count = options.shards ? options.shards : std::max(1u, options.loop_threads);
+    for (unsigned i = 0; i < count; i++) {
+        loops.emplace_back(new Loop{ listeners[i % listeners.size()], handler, options, pool });
+    }
+    return loops;
+}
+
+template<class Loop>
+void run_loops(std::vector<std::unique_ptr<Loop>>& loops, bool pinned)
+{
+    std::vector<std::thread> threads;
+    for (size_t i = pinned ? 0 : 1; i < loops.size(); i++) {
+        threads.emplace_back([&loop = *loops[i], i, pinned] {
+            if (pinned)
+                pin_to_core(i);
+            loop.run();
+        });
+    }
+    if (!pinned)
+        loops[0]->run();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+}
+
+// Event driven variant of serve, a fixed number of event loops share the listening socket (or get one each when
+// sharded) and multiplex all connections between them. Uses the same framing as connection::send and connection::recv.
+inline void serve(uint16_t port, reactor_handler handler, serve_options options = {})
+{
+    auto listeners = detail::listen_sharded(port, options);
+    for (int sockfd : listeners) {
+        if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1) {
+            throw unknown_connection_exception{ "" };
+        }
+    }
+    std::optional<worker_pool> pool;
+    if (options.workers) {
+        pool.emplace(*options.workers);
+    }
+    worker_pool* workers = pool ? &*pool : nullptr;
+
+#if SNL_IO_URING
+    if (options.backend == io_backend::io_uring) {
+        std::vector<std::unique_ptr<detail::uring_loop>> loops;
+        try {
+            loops = detail::make_loops<detail::uring_loop>(listeners, handler, options, workers);
+        } catch (const connection_exception&) {
+            loops.clear();
+        }
+        if (!loops.empty()) {
+            detail::run_loops(loops, options.shards > 0);
+        }
+    }
+#endif
+    auto loops = detail::make_loops<detail::event_loop>(listeners, handler, options, workers);
+    detail::run_loops(loops, options.shards > 0);
+
+    for (int sockfd : listeners) {
+        close(sockfd);
+    }
+}
+
+namespace sync {
+
+template<class T>
+class lock
+{
+public:
+    T* get() { return &data; }
+    T* operator->() { return &data; }
+
+private:
+    lock(T& data, std::mutex& mtx) : data(data), guard(mtx) {}
+
+    T& data;
+    std::lock_guard<std::mutex> guard;
+
+    template<class U>
+    friend class safe;
+};
+
+template<class T>
+class safe
+{
+public:
+    ~safe() = default;
+    template<typename... Args>
+    safe(Args&&... args)
+    {
+        data = T(std::forward<Args>(args)...);
+    }
+
+    lock<T> lock() { return sync::lock(data, mtx); }
+
+private:
+    T data;
+    std::mutex mtx;
+};
+
+template<class T>
+class read_view
+{
+public:
+    const T* get() const { return &data; }
+    const T* operator->() const { return &data; }
+
+private:
+    read_view(const T& data, std::shared_mutex& mtx) : data(data), guard(mtx) {}
+
+    const T& data;
+    std::shared_lock<std::shared_mutex> guard;
+
+    template<class U>
+    friend class safe_rw;
+};
+
+template<class T>
+class write_view
+{
+public:
+    T* get() { return &data; }
+    T* operator->() { return &data; }
+
+private:
+    write_view(T& data, std::shared_mutex& mtx) : data(data), guard(mtx) {}
+
+    T& data;
+    std::unique_lock<std::shared_mutex> guard;
+
+    template<class U>
+    friend class safe_rw;
+};
+
+// Like safe, but any number of readers can hold the data at once
+template<class T>
+class safe_rw
+{
+public:
+    ~safe_rw() = default;
+    template<typename... Args>
+    safe_rw(Args&&... args) : data(std::forward<Args>(args)...)
+    {
+    }
+
+    read_view<T> read_lock() { return read_view<T>(data, mtx); }
+    write_view<T> write_lock() { return write_view<T>(data, mtx); }
+
+private:
+    T data;
+    std::shared_mutex mtx;
+};
+
+// A fixed set of mutexes that keys are spread over, so unrelated keys rarely wait on each other
+template<size_t N = 64>
+class striped_lock
+{
+public:
+    // key is taken modulo N, hash it first if it is not already evenly spread
+    std::unique_lock<std::mutex> lock(size_t key) { return std::unique_lock<std::mutex>(stripes[key % N].mtx); }
+    static constexpr size_t size() { return N; }
+
+private:
+    struct alignas(64) stripe
+    {
+        std::mutex mtx;
+    };
+    std::array<stripe, N> stripes;
+};
+
+// Readers get an immutable version that stays alive for as long as they hold it, writers publish whole new versions
+template<class T>
+class snapshot
+{
+public:
+    ~snapshot() = default;
+    template<typename... Args>
+    snapshot(Args&&... args) : current(std::make_shared<const T>(std::forward<Args>(args)...))
+    {
+    }
+
+    std::shared_ptr<const T> load() const { return current.load(std::memory_order_acquire); }
+    void store(T value) { current.store(std::make_shared<const T>(std::move(value)), std::memory_order_release); }
+    // Applies fn to a copy of the current version and publishes it, retrying if another writer published first
+    template<class F>
+    void update(F&& fn)
+    {
+        std::shared_ptr<const T> expected = load();
+        std::shared_ptr<const T> next;
+        do {
+            auto copy = std::make_shared<T>(*expected);
+            fn(*copy);
+            next = std::move(copy);
+        } while (!current.compare_exchange_weak(expected, next, std::memory_order_acq_rel));
+    }
+
+private:
+    std::atomic<std::shared_ptr<const T>> current;
+};
+
+}
+
+namespace parsing {
+
+using command_handler = std::function<void(std::span<std::string>)>;
+
+// Context of parsers whose handlers take no per-call state
+struct no_context
+{
+};
+
+namespace detail {
+struct parameter
+{
+    parameter(const std::string& name, bool optional = false) : name(name), optional(optional) {}
+    std::string name;
+    bool optional; // passed to the handler as an empty view when the message leaves it out
+};
+template<class Context>
+struct command
+{
+    command() = default;
+    command(std::vector<parameter>&& parameters) : parameters(parameters) {}
+    std::vector<parameter> parameters;
+    std::function<void(Context&, std::span<std::string_view>)> handler;
+};
+struct string_hash
+{
+    using is_transparent = void;
+    size_t operator()(std::string_view str) const noexcept { return std::hash<std::string_view>{}(str); }
+};
+template<class Context>
+using command_map = std::unordered_map<std::string, command<Context>, string_hash, std::equal_to<>>;
+}
+
+class parsing_exception : public std::exception
+{
+public:
+    explicit parsing_exception(const std::string& message) : message(message) {}
+    const char* what() const noexcept override { return message.c_str(); }
+
+private:
+    std::string message;
 };
 
 namespace detail {
-template<class K, class V>
-std::vector<K> get_map_keys(const std::unordered_map<K, V>& map)
+template<class K, class V, class... Rest>
+std::vector<K> get_map_keys(const std::unordered_map<K, V, Rest...>& map)
 {
     std::vector<K> keys;
     keys.reserve(map.size());
@@ -382,77 +2099,417 @@ inline std::string concat_strings_formatted(const std::vector<std::string>& stri
     res[res.size() - 1] = ']';
     return res;
 }
+
+// Splits on whitespace like operator>> does, without copying
+class tokenizer
+{
+public:
+    explicit tokenizer(std::string_view input) : input(input) {}
+
+    bool next(std::string_view& token)
+    {
+        while (pos < input.size() && is_space(input[pos])) {
+            pos++;
+        }
+        if (pos == input.size()) {
+            return false;
+        }
+        size_t start = pos;
+        while (pos < input.size() && !is_space(input[pos])) {
+            pos++;
+        }
+        token = input.substr(start, pos - start);
+        return true;
+    }
+
+private:
+    static bool is_space(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    std::string_view input;
+    size_t pos = 0;
+};
+
+template<class T>
+bool parse_argument(std::string_view arg, T& value)
+{
+    if constexpr (std::is_same_v<T, std::string_view> || std::is_same_v<T, std::string>) {
+        value = T{ arg };
+        return true;
+    } else if constexpr (std::is_same_v<T, bool>) {
+        if (arg == "true" || arg == "1") {
+            value = true;
+        } else if (arg == "false" || arg == "0") {
+            value = false;
+        } else {
+            return false;
+        }
+        return true;
+    } else if constexpr (std::is_arithmetic_v<T>) {
+        auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+        return ec == std::errc{} && end == arg.data() + arg.size();
+    } else {
+        static_assert(sizeof(T) == 0, "unsupported parameter type");
+    }
+}
+
+template<class... Ts, class F, class Context, size_t... Is>
+void invoke_typed(const F& handler, Context& context, std::span<std::string_view> args,
+                  std::span<const std::string> names, std::index_sequence<Is...>)
+{
+    std::tuple<Ts...> values;
+    size_t failed = sizeof...(Ts);
+    if (!((parse_argument(args[Is], std::get<Is>(values)) || (failed = Is, false)) && ...)) {
+        throw parsing_exception{ std::format("invalid parameter {}: '{}'", names[failed], args[failed]) };
+    }
+    if constexpr (std::is_invocable_v<const F&, Context&, Ts...>) {
+        handler(context, std::move(std::get<Is>(values))...);
+    } else {
+        handler(std::move(std::get<Is>(values))...);
+    }
+}
+}
+
+namespace detail {
+// Commands rarely take more than a handful of parameters, keep those on the stack
+constexpr size_t INLINE_ARGS = 8;
+
+template<class Context>
+void invoke_command(const command<Context>& cmd, tokenizer& tokens, Context& context)
+{
+    std::array<std::string_view, INLINE_ARGS> inline_args;
+    std::vector<std::string_view> heap_args;
+    std::span<std::string_view> args{ inline_args.data(), std::min(cmd.parameters.size(), INLINE_ARGS) };
+    if (cmd.parameters.size() > INLINE_ARGS) {
+        heap_args.resize(cmd.parameters.size());
+        args = heap_args;
+    }
+    for (size_t i = 0; i < cmd.parameters.size(); i++) {
+        if (!tokens.next(args[i])) {
+            if (cmd.parameters[i].optional) {
+                args[i] = {};
+                continue;
+            }
+            throw parsing_exception{ std::format("expected parameter: {}", cmd.parameters[i].name) };
+        }
+    }
+    std::string_view str;
+    if (tokens.next(str)) {
+        throw parsing_exception{ std::format("extraneous parameter: '{}'", str) };
+    }
+    cmd.handler(context, args);
 }
 
-class message_parser
+constexpr uint64_t mix_command_hash(uint64_t h, uint32_t seed)
+{
+    h ^= seed * 0x9e3779b97f4a7c15;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    return h;
+}
+}
+
+// Perfect hash over a fixed set of command names, built at compile time (hash and displace)
+template<size_t N>
+class command_table
 {
 public:
-    void parse(const std::string& msg) const
+    static constexpr size_t npos = N;
+
+    constexpr command_table(const std::array<std::string_view, N>& names) : names(names)
     {
-        std::stringstream ss{ std::move(msg) };
-        std::string str;
-        auto cmd_names = detail::get_map_keys(commands);
-        if (!((ss >> str) && commands.contains(str))) {
-            throw parsing_exception{ std::format("expected command: {}", detail::concat_strings_formatted(cmd_names)) };
-        }
-        auto& cmd = commands.at(str);
-        std::vector<std::string> args;
-        for (auto& param : cmd.parameters) {
-            if (!((ss >> str))) {
-                throw parsing_exception{ std::format("expected parameter: {}", param.name) };
+        std::array<std::array<uint16_t, N>, BUCKETS> buckets{};
+        std::array<size_t, BUCKETS> bucket_sizes{};
+        for (size_t i = 0; i < N; i++) {
+            size_t b = fnv1a(names[i]) % BUCKETS;
+            buckets[b][bucket_sizes[b]++] = static_cast<uint16_t>(i);
+        }
+        std::array<size_t, BUCKETS> order{};
+        for (size_t i = 0; i < BUCKETS; i++) {
+            order[i] = i;
+        }
+        // Place the largest buckets first while the table is still empty
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return bucket_sizes[a] > bucket_sizes[b]; });
+        slots.fill(EMPTY);
+        for (size_t b : order) {
+            for (uint32_t seed = 0;; seed++) {
+                std::array<size_t, N> placed{};
+                size_t count = 0;
+                for (; count < bucket_sizes[b]; count++) {
+                    uint64_t h = fnv1a(names[buckets[b][count]]);
+                    size_t slot = detail::mix_command_hash(h, seed) & MASK;
+                    auto placed_end = placed.begin() + count;
+                    if (slots[slot] != EMPTY || std::find(placed.begin(), placed_end, slot) != placed_end) {
+                        break;
+                    }
+                    placed[count] = slot;
+                }
+                if (count == bucket_sizes[b]) {
+                    for (size_t i = 0; i < count; i++) {
+                        slots[placed[i]] = buckets[b][i];
+                    }
+                    seeds[b] = seed;
+                    break;
+                }
             }
-            args.emplace_back(std::move(str));
         }
-        if (ss >> str) {
-            throw parsing_exception{ std::format("extraneous parameter: '{}'", str) };
+    }
+
+    // Returns the index of the command in the declared names, or npos
+    constexpr size_t find(std::string_view name) const
+    {
+        uint64_t h = fnv1a(name);
+        uint16_t index = slots[detail::mix_command_hash(h, seeds[h % BUCKETS]) & MASK];
+        return index != EMPTY && names[index] == name ? index : npos;
+    }
+    constexpr std::string_view name(size_t index) const { return names[index]; }
+    constexpr size_t size() const { return N; }
+
+private:
+    static_assert(N > 0 && N < 0xffff);
+    static constexpr size_t BUCKETS = N / 4 + 1;
+    static constexpr size_t SLOTS = std::bit_ceil(N + N / 2 + 1);
+    static constexpr size_t MASK = SLOTS - 1;
+    static constexpr uint16_t EMPTY = 0xffff;
+
+    std::array<std::string_view, N> names;
+    std::array<uint32_t, BUCKETS> seeds{};
+    std::array<uint16_t, SLOTS> slots{};
+};
+
+template<class Context>
+class basic_message_parser_builder;
+
+// Immutable once built, parse can be called from several threads at once
+template<class Context = no_context>
+class basic_message_parser
+{
+public:
+    void parse(std::string_view msg, Context& context) const
+    {
+        detail::tokenizer tokens{ msg };
+        std::string_view str;
+        typename detail::command_map<Context>::const_iterator it;
+        if (!(tokens.next(str) && (it = commands.find(str)) != commands.end())) {
+            throw_expected_command();
         }
-        cmd.handler(args);
+        detail::invoke_command(it->second, tokens, context);
+    }
+    void parse(std::string_view msg) const
+        requires std::is_same_v<Context, no_context>
+    {
+        no_context context;
+        parse(msg, context);
     }
 
 private:
-    message_parser(std::unordered_map<std::string, detail::command>&& commands) : commands{ std::move(commands) } {}
-    std::unordered_map<std::string, detail::command> commands;
-    friend class message_parser_builder;
+    basic_message_parser(detail::command_map<Context>&& commands) : commands{ std::move(commands) } {}
+
+    [[noreturn]] void throw_expected_command() const
+    {
+        auto cmd_names = detail::get_map_keys(commands);
+        throw parsing_exception{ std::format("expected command: {}", detail::concat_strings_formatted(cmd_names)) };
+    }
+
+    detail::command_map<Context> commands;
+    friend class basic_message_parser_builder<Context>;
 };
 
-class message_parser_builder
+// Same as basic_message_parser, but dispatches through a command_table instead of a hash map
+template<size_t N, class Context = no_context>
+class static_message_parser
 {
 public:
-    message_parser_builder() = default;
-    message_parser_builder(const message_parser_builder&) = default;
-    message_parser_builder(message_parser_builder&&) = delete;
-    message_parser_builder& operator=(const message_parser_builder&) = delete;
-    message_parser_builder& operator=(message_parser_builder&&) = delete;
-    ~message_parser_builder() = default;
+    void parse(std::string_view msg, Context& context) const
+    {
+        detail::tokenizer tokens{ msg };
+        std::string_view str;
+        size_t index = command_table<N>::npos;
+        if (!(tokens.next(str) && (index = table.find(str)) != command_table<N>::npos)) {
+            throw_expected_command();
+        }
+        detail::invoke_command(commands[index], tokens, context);
+    }
+    void parse(std::string_view msg) const
+        requires std::is_same_v<Context, no_context>
+    {
+        no_context context;
+        parse(msg, context);
+    }
+
+private:
+    static_message_parser(const command_table<N>& table, std::array<detail::command<Context>, N>&& commands)
+        : table{ table }, commands{ std::move(commands) }
+    {
+    }
 
-    message_parser_builder& command(const std::string& name)
+    [[noreturn]] void throw_expected_command() const
+    {
+        std::vector<std::string> cmd_names;
+        cmd_names.reserve(N);
+        for (size_t i = 0; i < N; i++) {
+            cmd_names.emplace_back(table.name(i));
+        }
+        throw parsing_exception{ std::format("expected command: {}", detail::concat_strings_formatted(cmd_names)) };
+    }
+
+    command_table<N> table;
+    std::array<detail::command<Context>, N> commands;
+    friend class basic_message_parser_builder<Context>;
+};
+
+template<class Context, class... Ts>
+class typed_command_builder;
+
+// Handlers may take a Context& first, which is the context passed to parse
+template<class Context = no_context>
+class basic_message_parser_builder
+{
+public:
+    basic_message_parser_builder() = default;
+    basic_message_parser_builder(const basic_message_parser_builder&) = default;
+    basic_message_parser_builder(basic_message_parser_builder&&) = delete;
+    basic_message_parser_builder& operator=(const basic_message_parser_builder&) = delete;
+    basic_message_parser_builder& operator=(basic_message_parser_builder&&) = delete;
+    ~basic_message_parser_builder() = default;
+
+    basic_message_parser_builder& command(const std::string& name)
     {
         assert(!current_command);
-        auto [it, inserted] = commands.try_emplace(name, detail::command{});
+        auto [it, inserted] = commands.try_emplace(name, detail::command<Context>{});
         assert(inserted == true);
         current_command = &it->second;
         return *this;
     }
-    message_parser_builder& end(command_handler&& handler)
+    // Handlers callable with std::span<std::string_view> get views into the message, only valid for the duration of the
+    // call, others get owned strings
+    template<class F>
+    basic_message_parser_builder& end(F&& handler)
     {
         assert(current_command);
-        current_command->handler = std::move(handler);
+        if constexpr (std::is_invocable_v<F&, Context&, std::span<std::string_view>>) {
+            current_command->handler = std::forward<F>(handler);
+        } else if constexpr (std::is_invocable_v<F&, std::span<std::string_view>>) {
+            current_command->handler = [handler = std::forward<F>(handler)](Context&,
+                                                                            std::span<std::string_view> views) {
+                handler(views);
+            };
+        } else if constexpr (std::is_invocable_v<F&, Context&, std::span<std::string>>) {
+            std::function<void(Context&, std::span<std::string>)> owned = std::forward<F>(handler);
+            current_command->handler = [owned = std::move(owned)](Context& context, std::span<std::string_view> views) {
+                std::vector<std::string> args{ views.begin(), views.end() };
+                owned(context, args);
+            };
+        } else {
+            command_handler owned = std::forward<F>(handler);
+            current_command->handler = [owned = std::move(owned)](Context&, std::span<std::string_view> views) {
+                std::vector<std::string> args{ views.begin(), views.end() };
+                owned(args);
+            };
+        }
         current_command = nullptr;
         return *this;
     }
-    message_parser_builder& parameter(const std::string& name)
+    basic_message_parser_builder& parameter(const std::string& name)
     {
         assert(current_command);
+        if (!current_command->parameters.empty() && current_command->parameters.back().optional) {
+            throw std::logic_error{ std::format("required parameter {} follows an optional one", name) };
+        }
         current_command->parameters.push_back({ name });
         return *this;
     }
-    message_parser build() { return message_parser{ std::move(commands) }; }
+    // Optional parameters come after the required ones, and only untyped handlers take them (as an empty view when
+    // left out)
+    basic_message_parser_builder& optional_parameter(const std::string& name)
+    {
+        assert(current_command);
+        current_command->parameters.push_back({ name, true });
+        return *this;
+    }
+    // Typed parameters are converted before the handler is called, which then takes them as arguments
+    template<class T>
+    typed_command_builder<Context, T> parameter(const std::string& name)
+    {
+        assert(current_command);
+        // the handler's arguments line up with the message's from the first parameter on
+        if (!current_command->parameters.empty()) {
+            throw std::logic_error{ std::format("typed parameter {} follows an untyped one", name) };
+        }
+        current_command->parameters.push_back({ name });
+        return typed_command_builder<Context, T>{ *this };
+    }
+    basic_message_parser<Context> build() { return basic_message_parser<Context>{ std::move(commands) }; }
+    // Every command in the table must have been declared, and nothing else, otherwise this throws std::logic_error
+    template<size_t N>
+    static_message_parser<N, Context> build(const command_table<N>& table)
+    {
+        std::array<detail::command<Context>, N> ordered;
+        for (auto& [name, cmd] : commands) {
+            size_t index = table.find(name);
+            if (index == command_table<N>::npos) {
+                throw std::logic_error{ std::format("command '{}' is not in the command table", name) };
+            }
+            ordered[index] = std::move(cmd);
+        }
+        for (size_t i = 0; i < N; i++) {
+            if (!ordered[i].handler) {
+                throw std::logic_error{ std::format("command '{}' of the table was not declared", table.name(i)) };
+            }
+        }
+        commands.clear();
+        return static_message_parser<N, Context>{ table, std::move(ordered) };
+    }
 
 private:
-    std::unordered_map<std::string, detail::command> commands;
-    struct detail::command* current_command = nullptr;
+    detail::command_map<Context> commands;
+    detail::command<Context>* current_command = nullptr;
+    template<class C, class... Ts>
+    friend class typed_command_builder;
 };
 
+template<class Context, class... Ts>
+class typed_command_builder
+{
+public:
+    template<class T>
+    typed_command_builder<Context, Ts..., T> parameter(const std::string& name)
+    {
+        builder.current_command->parameters.push_back({ name });
+        return typed_command_builder<Context, Ts..., T>{ builder };
+    }
+    template<class F>
+    basic_message_parser_builder<Context>& end(F&& handler)
+    {
+        static_assert(std::is_invocable_v<const F&, Context&, Ts...> || std::is_invocable_v<const F&, Ts...>,
+                      "handler does not accept the declared parameter types");
+        std::array<std::string, sizeof...(Ts)> names;
+        for (size_t i = 0; i < names.size(); i++) {
+            names[i] = builder.current_command->parameters[i].name;
+        }
+        builder.current_command->handler = [handler = std::forward<F>(handler),
+                                            names = std::move(names)](Context& context,
+                                                                      std::span<std::string_view> args) {
+            detail::invoke_typed<Ts...>(handler, context, args, names, std::index_sequence_for<Ts...>{});
+        };
+        builder.current_command = nullptr;
+        return builder;
+    }
+
+private:
+    explicit typed_command_builder(basic_message_parser_builder<Context>& builder) : builder(builder) {}
+    basic_message_parser_builder<Context>& builder;
+    friend class basic_message_parser_builder<Context>;
+    template<class C, class... Us>
+    friend class typed_command_builder;
+};
+
+using message_parser = basic_message_parser<>;
+using message_parser_builder = basic_message_parser_builder<>;
+
 }
 
 }
\ No newline at end of file
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Makes a rename into the directory of path durable
+inline void sync_directory(const std::string& path)
+{
+    auto slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::system_error{ errno, std::generic_category(), "open " + dir };
+    }
+    int ret = fsync(fd);
+    ::close(fd);
+    if (ret == -1) {
+        throw std::system_error{ errno, std::generic_category(), "fsync " + dir };
+    }
+}
+
+enum class durability
+{
+    request,  // every append is on disk before commit returns, concurrent commits share one fdatasync
+    interval, // a background thread writes and syncs every interval, a power loss can lose that much
+    async,    // a background thread writes every interval but never syncs, the page cache decides
+};
+
+struct log_options
+{
+    durability mode = durability::request;
+    std::chrono::milliseconds interval{ 10 };
+};
+
+// Append-only log of balance changes. The file starts with a magic and a format version, then records of {payload
+// size, checksum} followed by {new balance, user name}. A torn record at the end (from a crash mid-write) fails its
+// checksum and is cut off on replay. Records hold the whole balance rather than a delta so replaying one that a
+// snapshot already covers is harmless. Positions count record bytes only, the file header is not part of them
+class balance_log
+{
+public:
+    // 1 had no file header and logged deltas, 2 logs absolute balances
+    static constexpr uint32_t VERSION = 2;
+
+    explicit balance_log(const std::string& path, log_options options = {}) : path(path), options(options)
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            throw std::system_error{ errno, std::generic_category(), "open " + path };
+        }
+        try {
+            check_format();
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        if (options.mode != durability::request) {
+            flusher = std::thread{ [this] { flush_loop(); } };
+        }
+    }
+    balance_log(const balance_log&) = delete;
+    balance_log& operator=(const balance_log&) = delete;
+    ~balance_log()
+    {
+        {
+            std::lock_guard guard{ mtx };
+            stopping = true;
+        }
+        flush_cv.notify_all();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        std::unique_lock lock{ mtx };
+        if (!pending.empty()) {
+            try {
+                flush(lock, options.mode != durability::async);
+            } catch (const std::exception& e) {
+                std::cerr << "writing " << path << " failed, the last records are lost: " << e.what() << '\n';
+            }
+        }
+        lock.unlock();
+        ::close(fd);
+    }
+
+    // Calls apply(name, balance) for every complete record, in order. Must run before the first append
+    template<class F>
+    void replay(F&& apply)
+    {
+        std::vector<char> data = read_all();
+        size_t pos = sizeof(file_header);
+        while (data.size() - pos >= sizeof(header)) {
+            header h;
+            std::memcpy(&h, data.data() + pos, sizeof(h));
+            if (h.size < sizeof(uint64_t) || data.size() - pos - sizeof(h) < h.size
+                || checksum({ data.data() + pos + sizeof(h), h.size }) != h.checksum) {
+                break;
+            }
+            uint64_t balance;
+            std::memcpy(&balance, data.data() + pos + sizeof(h), sizeof(balance));
+            apply(std::string_view{ data.data() + pos + sizeof(h) + sizeof(balance), h.size - sizeof(balance) },
+                  balance);
+            pos += sizeof(h) + h.size;
+        }
+        if (pos != data.size() && ftruncate(fd, pos) == -1) {
+            throw std::system_error{ errno, std::generic_category(), "ftruncate" };
+        }
+        std::lock_guard guard{ mtx };
+        appended = durable = base + pos - sizeof(file_header);
+    }
+
+    // Buffers a record and returns its position, which commit waits for. Records of the same user must be appended
+    // in the order their balances changed
+    uint64_t append(std::string_view name, uint64_t balance)
+    {
+        header h{ static_cast<uint32_t>(sizeof(balance) + name.size()), 0 };
+        std::lock_guard guard{ mtx };
+        size_t start = pending.size();
+        pending.resize(start + sizeof(h) + h.size);
+        char* payload = pending.data() + start + sizeof(h);
+        std::memcpy(payload, &balance, sizeof(balance));
+        std::memcpy(payload + sizeof(balance), name.data(), name.size());
+        h.checksum = checksum({ payload, h.size });
+        std::memcpy(pending.data() + start, &h, sizeof(h));
+        appended += sizeof(h) + h.size;
+        return appended;
+    }
+
+    // With durability::request, blocks until the log is synced up to position. Whoever finds no sync in progress
+    // writes and syncs everything buffered so far, the others wait for it and are usually covered by it. Throws
+    // std::system_error if the write or sync fails, the records stay buffered and the next flush tries them again
+    void commit(uint64_t position)
+    {
+        if (options.mode != durability::request || position <= durable.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::unique_lock lock{ mtx };
+        while (durable < position) {
+            if (syncing) {
+                synced_cv.wait(lock);
+                continue;
+            }
+            flush(lock, true);
+        }
+    }
+
+    // Position after the last appended record, everything up to it is covered by a snapshot taken afterwards
+    uint64_t position()
+    {
+        std::lock_guard guard{ mtx };
+        return appended;
+    }
+
+    // Drops the records before position once a snapshot covers them. The records after it are copied into a new
+    // file that atomically replaces the log, appends carry on meanwhile and go to the new file. On failure the log is
+    // left as it was, with the buffered records still queued
+    void compact(uint64_t position)
+    {
+        std::unique_lock lock{ mtx };
+        synced_cv.wait(lock, [this] { return !syncing; });
+        assert(base <= position && position <= appended);
+        syncing = true;
+        std::vector<char> batch;
+        batch.swap(pending);
+        uint64_t target = appended;
+        lock.unlock();
+        std::string tmp = path + ".tmp";
+        int new_fd = -1;
+        try {
+            write_all(fd, batch);
+            std::vector<char> tail = read_range(sizeof(file_header) + position - base, target - position);
+            new_fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            if (new_fd == -1) {
+                throw std::system_error{ errno, std::generic_category(), "open " + tmp };
+            }
+            write_all(new_fd, current_header());
+            write_all(new_fd, tail);
+            if (fdatasync(new_fd) == -1) {
+                throw std::system_error{ errno, std::generic_category(), "fdatasync" };
+            }
+            if (::rename(tmp.c_str(), path.c_str()) == -1) {
+                throw std::system_error{ errno, std::generic_category(), "rename " + tmp };
+            }
+        } catch (...) {
+            if (new_fd != -1) {
+                ::close(new_fd);
+                ::unlink(tmp.c_str());
+            }
+            restore(lock, std::move(batch));
+            throw;
+        }
+        ::close(fd);
+        lock.lock();
+        fd = new_fd;
+        base = position;
+        lock.unlock();
+        // durable is only advanced once the rename is, until then the next commit syncs the new file again
+        try {
+            sync_directory(path);
+        } catch (...) {
+            lock.lock();
+            syncing = false;
+            synced_cv.notify_all();
+            throw;
+        }
+        lock.lock();
+        durable = target;
+        syncing = false;
+        synced_cv.notify_all();
+    }
+
+private:
+    struct file_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+    };
+    static constexpr std::string_view MAGIC{ "SNLWAL\0\0", 8 };
+
+    struct header
+    {
+        uint32_t size;
+        uint32_t checksum;
+    };
+
+    static std::vector<char> current_header()
+    {
+        file_header h{};
+        std::memcpy(h.magic, MAGIC.data(), sizeof(h.magic));
+        h.version = VERSION;
+        std::vector<char> bytes(sizeof(h));
+        std::memcpy(bytes.data(), &h, sizeof(h));
+        return bytes;
+    }
+
+    // Writes the file header into a new log, and rejects logs of another format. Logs from before the header
+    // existed held deltas, replaying them as balances would corrupt every user they mention
+    void check_format()
+    {
+        std::vector<char> expected = current_header();
+        std::vector<char> data = read_range(0, std::min<uint64_t>(file_size(), expected.size()));
+        if (data.size() < expected.size() && std::equal(data.begin(), data.end(), expected.begin())) {
+            // new, or a crash cut the header short before any record could follow it
+            if (ftruncate(fd, 0) == -1) {
+                throw std::system_error{ errno, std::generic_category(), "ftruncate " + path };
+            }
+            write_all(fd, expected);
+            if (fdatasync(fd) == -1) {
+                throw std::system_error{ errno, std::generic_category(), "fdatasync " + path };
+            }
+            return;
+        }
+        file_header h;
+        std::memcpy(&h, data.data(), std::min(data.size(), sizeof(h)));
+        if (data.size() < sizeof(h) || std::string_view{ h.magic, sizeof(h.magic) } != MAGIC) {
+            throw std::runtime_error{ path + " has no format header, it was written by a version that logged deltas. "
+                                             "Replay it with that version and let it take a snapshot, or remove it" };
+        }
+        if (h.version != VERSION) {
+            throw std::runtime_error{ std::format("{} has format version {}, expected {}", path, h.version, VERSION) };
+        }
+    }
+
+    static uint32_t checksum(std::string_view data)
+    {
+        uint32_t h = 2166136261; // FNV-1a
+        for (char c : data) {
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619;
+        }
+        return h;
+    }
+
+    // Writes out what is buffered, with mtx held by lock on entry and exit but not during the write. On failure the
+    // file is cut back to where it was (a partly written batch would read as a torn record and cut off everything after
+    // it on replay) and the batch goes back in front of what was appended meanwhile
+    void flush(std::unique_lock<std::mutex>& lock, bool sync)
+    {
+        synced_cv.wait(lock, [this] { return !syncing; });
+        syncing = true;
+        std::vector<char> batch;
+        batch.swap(pending);
+        uint64_t target = appended;
+        lock.unlock();
+        try {
+            write_all(fd, batch);
+            if (sync && fdatasync(fd) == -1) {
+                throw std::system_error{ errno, std::generic_category(), "fdatasync" };
+            }
+        } catch (...) {
+            restore(lock, std::move(batch));
+            throw;
+        }
+        lock.lock();
+        durable = target;
+        syncing = false;
+        synced_cv.notify_all();
+    }
+
+    // Undoes a failed write of batch while syncing, with mtx not held on entry but held on exit
+    void restore(std::unique_lock<std::mutex>& lock, std::vector<char>&& batch)
+    {
+        // durable and base only change while syncing, which we are
+        (void)!ftruncate(fd, sizeof(file_header) + durable - base);
+        lock.lock();
+        batch.insert(batch.end(), pending.begin(), pending.end());
+        pending = std::move(batch);
+        syncing = false;
+        synced_cv.notify_all();
+    }
+
+    void flush_loop()
+    {
+        std::unique_lock lock{ mtx };
+        while (!stopping) {
+            flush_cv.wait_for(lock, options.interval, [this] { return stopping; });
+            if (!pending.empty()) {
+                try {
+                    flush(lock, options.mode == durability::interval);
+                } catch (const std::exception& e) {
+                    std::cerr << "writing " << path << " failed, retrying: " << e.what() << '\n';
+                }
+            }
+        }
+    }
+
+    static void write_all(int fd, const std::vector<char>& data)
+    {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                throw std::system_error{ errno, std::generic_category(), "write" };
+            }
+            written += n;
+        }
+    }
+
+    uint64_t file_size()
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            throw std::system_error{ errno, std::generic_category(), "fstat" };
+        }
+        return st.st_size;
+    }
+    std::vector<char> read_all() { return read_range(0, file_size()); }
+    std::vector<char> read_range(uint64_t offset, uint64_t size)
+    {
+        std::vector<char> data(size);
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = pread(fd, data.data() + done, data.size() - done, offset + done);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::system_error{ errno, std::generic_category(), "pread" };
+            }
+            done += n;
+        }
+        return data;
+    }
+
+    int fd;
+    std::string path;
+    log_options options;
+    std::mutex mtx;
+    std::condition_variable synced_cv;
+    std::condition_variable flush_cv;
+    std::vector<char> pending;
+    uint64_t base = 0; // position of the start of the file
+    uint64_t appended = 0;
+    std::atomic<uint64_t> durable = 0; // written under mtx, read without it by commit's fast path
+    bool syncing = false;
+    bool stopping = false;
+    std::thread flusher;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <sys/inotify.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+// Watches files in a directory for new versions. The directory is watched rather than the files, so a file that is
+// replaced by a rename (as editors and table::save do) keeps being watched
+class file_watcher
+{
+public:
+    file_watcher(const std::string& dir, std::vector<std::string> names) : names(std::move(names))
+    {
+        fd = inotify_init1(IN_CLOEXEC);
+        if (fd == -1) {
+            throw std::system_error{ errno, std::generic_category(), "inotify_init1" };
+        }
+        if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+            int err = errno;
+            ::close(fd);
+            throw std::system_error{ err, std::generic_category(), "inotify_add_watch " + dir };
+        }
+    }
+    file_watcher(const file_watcher&) = delete;
+    file_watcher& operator=(const file_watcher&) = delete;
+    ~file_watcher() { ::close(fd); }
+
+    // Blocks until at least one of the watched files has been written and closed or renamed into place, and returns
+    // each changed file once however many events it got
+    std::vector<std::string> wait()
+    {
+        alignas(inotify_event) char buf[4096];
+        std::vector<std::string> changed;
+        while (changed.empty()) {
+            ssize_t n = ::read(fd, buf, sizeof(buf));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                throw std::system_error{ errno, std::generic_category(), "read inotify" };
+            }
+            for (char* p = buf; p < buf + n;) {
+                auto* event = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->len == 0) {
+                    continue;
+                }
+                std::string name = event->name;
+                if (std::ranges::find(names, name) != names.end()
+                    && std::ranges::find(changed, name) == changed.end()) {
+                    changed.push_back(std::move(name));
+                }
+            }
+        }
+        return changed;
+    }
+
+private:
+    int fd;
+    std::vector<std::string> names;
+};